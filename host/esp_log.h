@@ -0,0 +1,14 @@
+// Host stand-in for esp_log.h
+// Just enough to build jo.c on Linux for jo_bench, not used for ESP builds
+
+#ifndef	ESP_LOG_H
+#define	ESP_LOG_H
+
+#include <stdio.h>
+
+#define	ESP_LOGE(tag,fmt,...)	fprintf(stderr,"E %s: " fmt "\n",tag,##__VA_ARGS__)
+#define	ESP_LOGW(tag,fmt,...)	fprintf(stderr,"W %s: " fmt "\n",tag,##__VA_ARGS__)
+#define	ESP_LOGI(tag,fmt,...)	do{}while(0)
+#define	ESP_LOGD(tag,fmt,...)	do{}while(0)
+
+#endif
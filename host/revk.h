@@ -0,0 +1,27 @@
+// Host stand-in for revk.h
+// Just enough to build jo.c on Linux for jo_bench, not used for ESP builds
+
+#ifndef	REVK_H
+#define	REVK_H
+
+#ifndef	_GNU_SOURCE
+#define	_GNU_SOURCE            // vasprintf
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "jo.h"
+#include "revk_ctype.h"
+
+#define freez(x) do{if(x){free((void*)x);x=NULL;}}while(0)
+
+void *mallocspi (size_t);       // Malloc from SPI preferred (plain malloc on host)
+uint32_t uptime (void);         // Seconds uptime
+
+#endif
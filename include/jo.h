@@ -6,7 +6,17 @@
 
 // Types
 
+#ifndef	JO_MAX
+#define	JO_MAX	64              // Max depth of JSON
+#endif
+
 typedef struct jo_s *jo_t;      // The JSON cursor used by all calls
+typedef struct
+{                               // Space for a cursor in caller storage (stack or static), for the _in functions, so no malloc for the cursor
+   void *p[6];
+   uint8_t b[8 + (JO_MAX + 7) / 8];
+} jo_cursor_t;
+typedef struct jo_arena_s *jo_arena_t;  // Arena, for many allocations that are all freed in one go
 typedef enum
 {                               // The parse data value type we are at
    JO_END,                      // Not a value, we are at the end, or in an error state
@@ -35,9 +45,16 @@ jo_t jo_parse_str (const char *buf);
 jo_t jo_parse_query (const char *buf);
 // Parse a query string format into a JSON object string (allocated) - all fields treated as strings
 
+jo_t jo_parse_query_insitu (char *buf, size_t len);
+// As jo_parse_query, but buf is malloc'd and the JSON is made in buf itself (realloc'd as needed), so no second allocation
+// The jo_t then owns buf, freed by jo_free (or if NULL returned)
+
 jo_t jo_parse_mem (const void *buf, size_t len);
 // Start parsing a JSON string in memory - does not need a null
 
+jo_t jo_parse_cbor (const void *buf, size_t len);
+// Convert CBOR to JSON (allocated) and start parsing it. Byte strings become base64 (base16 if tagged 23). Check jo_error for bad CBOR
+
 jo_t jo_create_mem (void *buf, size_t len);
 // Start creating JSON in memory at buf, max space len.
 
@@ -47,11 +64,43 @@ jo_t jo_create_alloc (void);
 jo_t jo_object_alloc (void);
 // As so common, this does jo_create_alloc(), and jo_object()
 
+void jo_cbor (jo_t);
+// Before adding anything, switch to creating CBOR instead of JSON, using the same calls (jo_base64/jo_base16 add byte strings)
+// Objects and arrays are indefinite length, jo_json converts JSON to CBOR. Use jo_len before jo_finish/jo_finisha to get the length
+
+jo_t jo_parse_str_in (jo_cursor_t *, const char *buf);
+jo_t jo_parse_mem_in (jo_cursor_t *, const void *buf, size_t len);
+jo_t jo_create_mem_in (jo_cursor_t *, void *buf, size_t len);
+jo_t jo_create_alloc_in (jo_cursor_t *);
+jo_t jo_object_alloc_in (jo_cursor_t *);
+// As above, but the cursor is in the jo_cursor_t provided (or malloc'd if NULL), e.g. jo_cursor_t c; jo_t j = jo_parse_mem_in (&c, buf, len);
+// Use as normal, jo_free, jo_finish, etc, free any allocated buffer but not the cursor, so it must stay valid until then
+
+jo_arena_t jo_arena (size_t size);
+// New arena, allocating chunks of size (more added if needed). Allocation is then just moving a pointer, and nothing is freed until jo_arena_free
+void *jo_arena_alloc (jo_arena_t, size_t);
+// Allocate from arena (aligned), NULL if no memory. Not freed individually
+char *jo_arena_strdup (jo_arena_t, const char *);
+// Copy of string in arena (NULL if passed NULL)
+void *jo_arena_mark (jo_arena_t);
+void jo_arena_release (jo_arena_t, void *mark);
+// Free everything allocated in the arena since jo_arena_mark, e.g. per item in a loop, so the arena does not keep growing
+void jo_arena_free (jo_arena_t *);
+// Free arena and everything in it, including cursors and JSON made with it (safe to call with NULL or pointer to NULL)
+
+jo_t jo_parse_str_arena (jo_arena_t, const char *buf);
+jo_t jo_parse_mem_arena (jo_arena_t, const void *buf, size_t len);
+jo_t jo_create_arena (jo_arena_t);
+jo_t jo_object_arena (jo_arena_t);
+// As above, but the cursor, buffer, index (jo_index), jo_strdup, jo_strdupj and jo_copy are all from the arena, so do not free them
+// jo_free and jo_finish work as normal (jo_finish returns JSON in the arena), but need not be called, jo_finisha returns NULL
+
 jo_t jo_pad (jo_t *, int);
 // Attempt to ensure padding on jo, else free jo and return NULL
 
 jo_t jo_copy (jo_t);
 // Copy object - copies the object, and if allocating memory, makes copy of the allocated memory too
+// Except when parsing shared JSON (jo_parse_shared), as that is then shared, not copied
 
 const char *jo_rewind (jo_t);
 // Move to start for parsing. If was writing, closed and set up to read instead. Clears error if reading. Safe to call with NULL
@@ -78,8 +127,35 @@ char *jo_finisha (jo_t *);
 // Finish creating allocated JSON, returns start of alloc'd memory if no error. Frees j. If NULL returned then any allocated space also freed
 // It is an error to use with non jo_create_alloc
 
+void jo_head (jo_t, int head);
+// Reserve head room (up to 255 bytes) in front of allocated JSON, so a protocol header can be written in place in front of it, see jo_finish_head
+// jo_finisha still works (moving the JSON down), best done before adding anything
+
+char *jo_finish_head (jo_t *, size_t * headp, size_t * lenp);
+// As jo_finisha, but returns the start of the allocation (to free), with the JSON at *headp in to it, after the head room, and *lenp long (with a null after)
+
 int jo_len (jo_t);              // Current length of object (including any closing needed)
 
+// Shared JSON, immutable and reference counted, so one finished JSON can be passed to several places (e.g. MQTT clients, mesh, queues)
+// with no copying, and is freed when the last reference is dropped
+typedef struct jo_shared_s *jo_shared_t;
+
+jo_shared_t jo_share (jo_t *);
+// Finish allocated JSON (as jo_finisha) as shared JSON, with one reference. Frees j. NULL if error
+
+jo_shared_t jo_shared_ref (jo_shared_t);
+// Add a reference, returns the same jo_shared_t
+
+void jo_shared_free (jo_shared_t *);
+// Drop a reference, freeing if the last one (safe to call with NULL or pointer to NULL)
+
+const char *jo_shared_json (jo_shared_t);
+size_t jo_shared_len (jo_shared_t);
+// The JSON (null terminated), and its length
+
+jo_t jo_parse_shared (jo_shared_t);
+// Start parsing shared JSON, with no copy, holding a reference until jo_free
+
 // Creating
 // Note that tag is required if in an object and must be null if not
 
@@ -109,6 +185,9 @@ void jo_litf (jo_t, const char *tag, const char *format, ...);
 void jo_datetime (jo_t j, const char *tag, time_t t);
 // Add a datetime (ISO, Z)
 
+void jo_datetime_us (jo_t j, const char *tag, int64_t us, uint8_t places, int offset);
+// Add a datetime from microseconds since epoch, with places (0-6) decimal places of seconds, and offset minutes ahead of UTC (0 for Z)
+
 extern const char JO_BASE64[];
 extern const char JO_BASE32[];
 extern const char JO_BASE16[];
@@ -120,6 +199,7 @@ void jo_baseN (jo_t j, const char *tag, const void *src, size_t slen, uint8_t bi
 #define	jo_base16(j,t,m,l) jo_baseN(j,t,m,l,4,JO_BASE16)
 
 ssize_t jo_strncpyd (jo_t j, void *dst, size_t dlen, uint8_t bits, const char *alphabet);
+// Decode string in base, alphabet must be ASCII, case insensitive for base 16/32. Spaces and nulls are skipped, = ends, any other character not in alphabet is -1
 #define	jo_strncpy64(j,d,dl) jo_strncpyd(j,d,dl,6,JO_BASE64)
 #define	jo_strncpy32(j,d,dl) jo_strncpyd(j,d,dl,5,JO_BASE32)
 #define	jo_strncpy16(j,d,dl) jo_strncpyd(j,d,dl,4,JO_BASE16)
@@ -127,6 +207,12 @@ ssize_t jo_strncpyd (jo_t j, void *dst, size_t dlen, uint8_t bits, const char *a
 void jo_int (jo_t, const char *tag, int64_t);
 // Add an integer
 
+void jo_float (jo_t, const char *tag, double);
+// Add a number, the shortest that reads back as the same double (null if NaN or infinite)
+
+void jo_fixed (jo_t, const char *tag, double, uint8_t places);
+// Add a number with fixed decimal places, as %.*f (null if NaN or infinite), except a negative value rounding to 0 is 0 not -0
+
 void jo_bool (jo_t, const char *tag, int);
 // Add a bool (true if non zero passed)
 
@@ -144,9 +230,30 @@ jo_type_t jo_next (jo_t);
 jo_type_t jo_skip (jo_t);
 // Skip this value to next value AT THE SAME LEVEL, typically used where a tag is not what you are looking for, etc
 
+jo_type_t jo_validate (jo_t);
+// As jo_skip, but a fast check only, in one pass over the raw bytes without decoding, for validating untrusted JSON. Same errors and positions as jo_skip
+
 jo_type_t jo_find (jo_t, const char *);
 // Rewind and look for path, e.g. tag.tag... and return type of value for that point. Does not do arrays, yet. JO_END for no find
 
+typedef struct jo_find_s jo_find_t;
+struct jo_find_s
+{                               // Entry in table for jo_find_many
+   const char *path;            // Path, as jo_find
+   void *dst;                   // If set, value copied here (jo_strncpy) if found, empty string if object/array, left as is if not found
+   size_t len;                  // Size of dst
+   void (*cb) (jo_t, jo_find_t *);      // If set, called with cursor at value (own cursor, so can jo_next, etc, in to value)
+   void *arg;                   // For use by cb
+   jo_type_t type;              // Set to type of value found, JO_END if not found
+};
+int jo_find_many (jo_t, jo_find_t *, int n);
+// Rewind and look for n paths (as jo_find) in one pass, setting type, and dst and calling cb for each found. Returns number found
+// Use in place of several jo_find calls as each jo_find is a whole new scan (unless indexed, see jo_index)
+
+void jo_index (jo_t);
+// Request a structural index of a parsed JSON, built in one pass when next needed by jo_find, jo_find_many or jo_skip
+// jo_find then looks up each tag by hash, and jo_skip hops over values, rather than scanning. Freed by jo_free. If no memory, scanning is used as normal
+
 ssize_t jo_strlen (jo_t);
 // Return byte length, if a string or tag this is the decoded byte length, else length of literal
 
@@ -158,15 +265,44 @@ ssize_t jo_strncmp (jo_t, void *, size_t max);
 
 #define jo_strcmp(j,s) jo_strncmp(j,s,strlen(s))
 
-// Allocate a copy of string
+ssize_t jo_view (jo_t, const char **);
+// As jo_strlen, and if no decoding is needed (no escapes) also sets the pointer to the value in the JSON buffer (not NULL terminated), else sets NULL
+
+char *jo_strinsitu (jo_t);
+// At a string, decode it in place in the JSON buffer (which must be writable, e.g. payload from lwmqtt), returning NULL terminated string, and move on as jo_next
+// This changes the JSON buffer, so jo_rewind (and so jo_find) then fails
+
+// Allocate a copy of string (in the arena if an arena cursor)
 char *jo_strdup (jo_t);
 
-// Allocate a copy of raw JSON value
+// Allocate a copy of raw JSON value (in the arena if an arena cursor)
 char *jo_strdupj (jo_t j);
 
+// As jo_strdup and jo_strdupj, but in the arena (malloc if NULL), e.g. for a cursor that was not made in an arena
+char *jo_strdup_arena (jo_t, jo_arena_t);
+char *jo_strdupj_arena (jo_t, jo_arena_t);
+
 // Get a number
 int64_t jo_read_int (jo_t);
 long double jo_read_float (jo_t);
 
-// Get a datetime
+// Get a datetime, ISO, with optional time, seconds, fraction, and Z or offset (else local time), -1 if not valid
+// As mktime, -1 is also a valid time (1969-12-31T23:59:59Z, or 23:59:59.999999Z for _us) which cannot be told apart from not valid
 time_t jo_read_datetime (jo_t);
+int64_t jo_read_datetime_us (jo_t);     // In microseconds
+
+// Streaming parse, for JSON arriving in chunks, using bounded memory
+// The callback is called for each tag and value (and JO_CLOSE) with j at that point, and the whole of that tag or value in memory
+// So the callback can use jo_here, jo_level, jo_strncpy, jo_strncmp, jo_view, jo_read_int, etc, but not jo_next, jo_skip, jo_find, or jo_rewind
+// The callback returns an error to stop parsing, or NULL to carry on
+typedef struct jo_stream_s *jo_stream_t;
+typedef const char *jo_stream_cb_t (void *arg, jo_t j, jo_type_t t);
+
+jo_stream_t jo_stream (size_t max, jo_stream_cb_t * cb, void *arg);
+// Start a streaming parse, max is the longest tag or value (as raw JSON) allowed. NULL if no memory
+
+const char *jo_stream_data (jo_stream_t, const void *data, size_t len);
+// Parse next chunk of JSON, returns error if any (and any later call returns the same error)
+
+const char *jo_stream_end (jo_stream_t *);
+// End of JSON, returns error if any (e.g. JSON unclosed), and frees the stream. Safe to call with NULL or pointer to NULL
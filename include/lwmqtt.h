@@ -1,10 +1,11 @@
 #ifndef	LWMQTT_H
 #define	LWMQTT_H
 // Light weight MQTT client
-// QoS 0 only, no queuing or resending (using TCP to do that for us)
-// Live sending to TCP for outgoing messages
+// QoS 0, and QoS 1 publish (if window set) kept and resent on reconnect until acked
+// Live sending to TCP for outgoing messages, or optionally queued
 // Simple callback for incoming messages
 // Automatic reconnect
+// A task per client, or optionally one task for all clients (CONFIG_REVK_MQTT_ONETASK)
 
 // Callback function for a connection (client or server)
 // For client, the arg passed is as specified in the client config
@@ -21,7 +22,10 @@
 // Called as server for subscribe
 // - Topic is subscribe pattern
 // - Payload is NULL
-typedef void lwmqtt_callback_t (void *arg, char *topic, unsigned short len, unsigned char *payload);
+typedef void lwmqtt_callback_t (void *arg, char *topic, int len, unsigned char *payload);
+
+// Callback when a queued message is sent (err NULL) or dropped (err is reason), ref as passed to lwmqtt_send_ref
+typedef void lwmqtt_sent_t (void *arg, void *ref, const char *err);
 
 typedef struct lwmqtt_client_config_s lwmqtt_client_config_t;
 
@@ -37,11 +41,19 @@ struct lwmqtt_client_config_s
    const char *tlsname;         // Name of cert if not host name
    unsigned short port;         // Port 0=auto
    unsigned short keepalive;    // 0=default
+   uint32_t rxmax;              // Max incoming message size, larger are logged and dropped (0 for default)
    // Will
    const char *topic;           // Will topic
    int plen;                    // Will payload len (-1 does strlen)
    const unsigned char *payload;        // Will payload
    uint8_t retain:1;            // Will retain
+   // Queue
+   unsigned short queue;        // Queue up to this many messages, sent by client task (0 sends directly in caller)
+   uint8_t queue_old:1;         // When queue full, drop the oldest rather than the new message
+   lwmqtt_sent_t *sent;         // Called for each queued message when sent or dropped, and QoS 1 when acked or dropped
+   // QoS 1
+   unsigned short window;       // QoS 1 messages in flight awaiting PUBACK (0 for no QoS 1)
+   uint32_t qosmem;             // Max bytes of QoS 1 messages held, in flight or waiting (0 for default)
    // TLS
    void *ca_cert_buf;           // For checking server - assumed we need to make a copy
    int ca_cert_bytes;
@@ -65,6 +77,7 @@ struct lwmqtt_server_config_s
 {
    lwmqtt_callback_t *callback;
    unsigned short port;         // Port 0=auto
+   uint32_t rxmax;              // Max incoming message size, larger are logged and dropped (0 for default)
    // TLS
    void *ca_cert_buf;           // For checking server
    int ca_cert_bytes;
@@ -106,8 +119,20 @@ const char *lwmqtt_subscribeub (lwmqtt_t, const char *topic, char unsubscribe);
 
 // Send (return is non null error message if failed) (-1 tlen or plen do strlen)
 const char *lwmqtt_send_full (lwmqtt_t, int tlen, const char *topic, int plen, const unsigned char *payload, char retain);
+// As lwmqtt_send_full, with ref for sent callback if queued
+const char *lwmqtt_send_ref (lwmqtt_t, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, void *ref);
+// Send QoS 1, held (even if not connected) and resent (DUP) on reconnect until PUBACK, then sent callback with ref
+const char *lwmqtt_send_qos1 (lwmqtt_t, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, void *ref);
 // Simpler
 #define lwmqtt_send(h,t,l,p) lwmqtt_send_full(h,-1,t,l,p,0,0);
+// Send with no copy, writing the header in the head bytes of space in front of payload, e.g. from jo_finish_head (falls back to lwmqtt_send_full if not enough)
+const char *lwmqtt_send_head (lwmqtt_t, int head, int tlen, const char *topic, int plen, unsigned char *payload, char retain);
+// Head room needed for a topic of tlen
+#define LWMQTT_HEAD(tlen) (7+(tlen))
+// Streaming send, of plen payload, sent in parts by lwmqtt_send_more, then lwmqtt_send_end, all from the same task (other sends wait until end)
+const char *lwmqtt_send_start (lwmqtt_t, int tlen, const char *topic, int plen, char retain);
+const char *lwmqtt_send_more (lwmqtt_t, int len, const unsigned char *data);
+const char *lwmqtt_send_end (lwmqtt_t);  // Error if not all plen sent, and connection is closed to reconnect
 
 // Simple send - non retained no wait topic ends on space then payload
 const char *lwmqtt_send_str (lwmqtt_t, const char *msg);
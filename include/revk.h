@@ -96,6 +96,7 @@ extern led_strip_handle_t revk_strip;
 #endif
 
 jo_t jo_make (const char *nodename);    // Start object with node name
+jo_t jo_make_in (jo_cursor_t *, const char *nodename);  // As jo_make, cursor in caller storage (see jo_create_alloc_in)
 
 #define freez(x) do{if(x){free((void*)x);x=NULL;}}while(0)      // Just useful - yes free(x) is valid when x is NULL, but this sets x NULL as a result as well
 
@@ -204,6 +205,9 @@ void revk_mesh_send_json (const mac_t mac, jo_t * jp);
 #endif
 #ifdef	CONFIG_REVK_MQTT
 char *revk_topic (const char *name, const char *id, const char *suffix);
+int revk_topic_buf (char *buf, int size, const char *name, const char *id, const char *suffix);  // As revk_topic in to buf, returns length (as snprintf)
+#define	REVK_TOPIC	100     // Max topic (inc null) sent with no copy
+#define	REVK_HEAD	LWMQTT_HEAD(REVK_TOPIC) // Head room jo_make allows for MQTT or mesh header
 void revk_send_subunsub (int client, const mac_t,uint8_t sub);
 #define revk_send_sub(c,m) revk_send_subunsub(c,m,1)
 #define revk_send_unsub(c,m) revk_send_subunsub(c,m,0)
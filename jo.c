@@ -10,31 +10,101 @@
 #include <time.h>
 #include <math.h>
 #include "esp_log.h"
-
-#ifndef	JO_MAX
-#define	JO_MAX	64
+#ifdef	__SSE2__
+#include <emmintrin.h>
 #endif
 
+struct jo_shared_s
+{                               // Immutable reference counted JSON, this is after the JSON (and null) in the same allocation
+   uint32_t refs;               // References
+   uint32_t len;                // Length of JSON
+};
+#define	JO_SHARED_OFF(l)	(((l)+__alignof__(struct jo_shared_s))&~(__alignof__(struct jo_shared_s)-1))  // Offset of jo_shared_s from start of JSON
+#define	JO_SHARED(j)	((jo_shared_t)((j)->buf+JO_SHARED_OFF((j)->len)))    // jo_shared_t from shared parse cursor
+
+typedef struct jo_index_s jo_index_t;
+struct jo_index_s
+{                               // Structural index of a parsed JSON, one entry per tag, value, and close, in order, then a hash table of tags
+   uint32_t count;              // Entries
+   uint32_t mask;               // Hash table size - 1
+   uint32_t *hash;              // Hash table (after e[]), tag entry + 1 (0 for empty slot), by object entry and tag
+   struct
+   {
+      uint32_t pos;             // Offset in buf of this tag/value/close
+      uint32_t skip;            // Entry after this (i.e. after whole object/array for open), so next sibling or close of parent
+      uint32_t up;              // Entry of object this tag is in, JO_NOTAG if not a tag
+   } e[];
+};
+#define	JO_NOTAG	0xFFFFFFFF
+
 struct jo_s
 {                               // cursor to JSON object
    char *buf;                   // Start of JSON string
    const char *err;             // If in error state
    size_t ptr;                  // Pointer in to buf
    size_t len;                  // Max space for buf
+   jo_arena_t arena;            // Allocating from arena, if set
+   jo_index_t *index;           // Structural index, if built (jo_index)
    uint8_t parse:1;             // This is parsing, not generating
    uint8_t alloc:1;             // buf is malloced space
    uint8_t comma:1;             // Set if comma needed / expected
    uint8_t tagok:1;             // We have skipped an expected tag already in parsing
    uint8_t null:1;              // We have a null termination (last character stored was 0)
    uint8_t lt:1;                // Last character stored was <
+   uint8_t insitu:1;            // Buffer has been changed by jo_strinsitu
+   uint8_t more:1;              // Streaming, end of buf is not end of JSON
+   uint8_t stack:1;             // Cursor is in caller storage (jo_cursor_t or arena), so not freed
+   uint8_t cbor:1;              // Creating CBOR, not JSON
+   uint8_t shared:1;            // buf is a jo_shared_t, holding a reference
+   uint8_t indexing:1;          // Build index when next needed
    uint8_t level;               // Current level
+   uint8_t head;                // Head room in front of buf in the allocation (jo_head)
    uint8_t o[(JO_MAX + 7) / 8]; // Bit set at each level if level is object, else it is array
 };
 
+// Word at a time scanning (SWAR), aligned loads only as not all targets allow unaligned
+typedef uintptr_t __attribute__((may_alias)) jo_word_t;
+#define	JO_WORD(b)	((uintptr_t)~(uintptr_t)0/0xFF*(b))   // b in every byte
+#define	JO_ZERO(w)	(((w)-JO_WORD(0x01))&~(w)&JO_WORD(0x80))      // Non zero if any byte is zero
+#define	JO_ALIGNED(p)	(!((uintptr_t)(p)&(sizeof(jo_word_t)-1)))
+
 const char JO_BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 const char JO_BASE32[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
 const char JO_BASE16[] = "0123456789ABCDEF";
 
+static const uint8_t jo_dec64[128] = {  // Value+1 for each character, 0 if not in alphabet
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 63, 0, 0, 0, 64,
+   53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 0, 0, 0, 0, 0, 0,
+   0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+   16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 0, 0, 0, 0, 0,
+   0, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41,
+   42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t jo_dec32[128] = {  // Value+1 for each character, 0 if not in alphabet
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 27, 28, 29, 30, 31, 32, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+   16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 0, 0, 0, 0, 0,
+   0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+   16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t jo_dec16[128] = {  // Value+1 for each character, 0 if not in alphabet
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0, 0, 0, 0, 0, 0,
+   0, 11, 12, 13, 14, 15, 16, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 11, 12, 13, 14, 15, 16, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
 // Note escaping / is optional but done always to avoid </script> issues
 #define escapes \
         esc ('"', '"') \
@@ -45,16 +115,157 @@ const char JO_BASE16[] = "0123456789ABCDEF";
         esc ('r', '\r') \
         esc ('t', '\t') \
 
+_Static_assert (sizeof (struct jo_s) <= sizeof (jo_cursor_t), "jo_cursor_t too small");
+
+#define	JO_ARENA_ALIGN	8
+#define	JO_ARENA_ROUND(n)	(((n)+JO_ARENA_ALIGN-1)&~(size_t)(JO_ARENA_ALIGN-1))
+
+typedef struct jo_chunk_s jo_chunk_t;
+struct jo_chunk_s
+{                               // Arena chunk
+   jo_chunk_t *next;            // Older chunk
+   size_t size;                 // Space in chunk
+   size_t used;                 // Space used
+   uint8_t data[] __attribute__((aligned (JO_ARENA_ALIGN)));
+};
+
+struct jo_arena_s
+{                               // Arena, allocating from the newest chunk, the first chunk is in the same allocation
+   jo_chunk_t *chunk;           // Newest chunk
+   size_t size;                 // Size for new chunks
+};
+
+jo_arena_t
+jo_arena (size_t size)
+{                               // New arena
+   size = JO_ARENA_ROUND (size ? : 1);
+   jo_arena_t a = mallocspi (JO_ARENA_ROUND (sizeof (*a)) + sizeof (jo_chunk_t) + size);
+   if (!a)
+      return a;
+   a->chunk = (jo_chunk_t *) ((uint8_t *) a + JO_ARENA_ROUND (sizeof (*a)));
+   a->chunk->next = NULL;
+   a->chunk->size = size;
+   a->chunk->used = 0;
+   a->size = size;
+   return a;
+}
+
+void *
+jo_arena_alloc (jo_arena_t a, size_t n)
+{                               // Allocate from arena
+   if (!a)
+      return NULL;
+   n = JO_ARENA_ROUND (n ? : 1);
+   jo_chunk_t *c = a->chunk;
+   if (c->size - c->used < n)
+   {                            // New chunk, at least big enough
+      if (!(c = mallocspi (sizeof (*c) + (n > a->size ? n : a->size))))
+         return c;
+      c->next = a->chunk;
+      c->size = (n > a->size ? n : a->size);
+      c->used = 0;
+      a->chunk = c;
+   }
+   void *m = c->data + c->used;
+   c->used += n;
+   return m;
+}
+
+static void *
+jo_arena_realloc (jo_arena_t a, void *m, size_t old, size_t n)
+{                               // Grow allocation, in place if it is the last one and fits, else moved (old space is not reused)
+   jo_chunk_t *c = a->chunk;
+   if (m && (uint8_t *) m + JO_ARENA_ROUND (old) == c->data + c->used && (uint8_t *) m + JO_ARENA_ROUND (n) <= c->data + c->size)
+   {
+      c->used = (uint8_t *) m + JO_ARENA_ROUND (n) - c->data;
+      return m;
+   }
+   void *new = jo_arena_alloc (a, n);
+   if (new && m)
+      memcpy (new, m, old < n ? old : n);
+   return new;
+}
+
+char *
+jo_arena_strdup (jo_arena_t a, const char *s)
+{                               // Copy string in arena
+   if (!s)
+      return NULL;
+   size_t l = strlen (s) + 1;
+   char *d = jo_arena_alloc (a, l);
+   if (d)
+      memcpy (d, s, l);
+   return d;
+}
+
+void *
+jo_arena_mark (jo_arena_t a)
+{                               // Current position in arena
+   if (!a)
+      return NULL;
+   return a->chunk->data + a->chunk->used;
+}
+
+void
+jo_arena_release (jo_arena_t a, void *mark)
+{                               // Free everything allocated since mark
+   if (!a || !mark)
+      return;
+   jo_chunk_t *c;
+   while ((c = a->chunk)->next && ((uint8_t *) mark < c->data || (uint8_t *) mark > c->data + c->size))
+   {                            // Newer chunk
+      a->chunk = c->next;
+      free (c);
+   }
+   c->used = (uint8_t *) mark - c->data;
+}
+
+void
+jo_arena_free (jo_arena_t * ap)
+{                               // Free arena
+   if (!ap)
+      return;
+   jo_arena_t a = *ap;
+   if (!a)
+      return;
+   *ap = NULL;
+   jo_chunk_t *c;
+   while ((c = a->chunk) && c->next)
+   {                            // The last (first made) is part of a
+      a->chunk = c->next;
+      free (c);
+   }
+   free (a);
+}
+
 static jo_t
-jo_new (void)
-{                               // Create a jo_t
-   jo_t j = mallocspi (sizeof (*j));
+jo_new (jo_cursor_t * c)
+{                               // Create a jo_t, in c if not NULL
+   jo_t j = (c ? (jo_t) c : mallocspi (sizeof (*j)));
    if (!j)
       return j;                 // Malloc fail
    memset (j, 0, sizeof (*j));
+   j->stack = (c ? 1 : 0);
    return j;
 }
 
+static jo_t
+jo_arena_set (jo_t j, jo_arena_t a)
+{                               // Cursor is from and allocates in arena
+   if (j)
+      j->arena = a;
+   return j;
+}
+
+static void
+jo_del (jo_t j)
+{                               // Free the cursor itself, and its index
+   if (!j->arena)
+      free (j->index);
+   if (!j->stack)
+      free (j);
+}
+
 static void *
 saferealloc (void *m, size_t len)
 {
@@ -64,21 +275,65 @@ saferealloc (void *m, size_t len)
    return n;
 }
 
-static inline void
-jo_store (jo_t j, uint8_t c)
-{                               // Write out byte
+static void *
+jo_malloc (jo_t j, size_t n)
+{                               // Allocate for j
+   if (j->arena)
+      return jo_arena_alloc (j->arena, n);
+   return mallocspi (n);
+}
+
+static void *
+jo_realloc (jo_t j, void *m, size_t old, size_t n)
+{                               // Reallocate for j, freeing m if fails
+   if (j->arena)
+      return jo_arena_realloc (j->arena, m, old, n);
+   return saferealloc (m, n);
+}
+
+static void
+jo_mfree (jo_t j, void *m)
+{                               // Free for j (nothing if arena)
+   if (!j->arena)
+      free (m);
+}
+
+static char *
+jo_buf_realloc (jo_t j, size_t len)
+{                               // Reallocate buf for j, to len, keeping any head room in front, freeing buf if fails
+   char *m = jo_realloc (j, j->buf ? j->buf - j->head : NULL, j->buf ? j->head + j->len : 0, j->head + len);
+   return m ? m + j->head : m;
+}
+
+static int
+jo_space (jo_t j, size_t n)
+{                               // Ensure space for n bytes at ptr, growing allocated buffer geometrically. Returns 0 if not
    if (!j || j->err)
-      return;
+      return 0;
    if (j->parse)
    {
       j->err = "Writing to read only JSON";
-      return;
+      return 0;
    }
-   if (j->ptr >= j->len && (!j->alloc || !(j->buf = saferealloc (j->buf, j->len += 100))))
+   if (j->ptr + n <= j->len)
+      return 1;
+   size_t len = j->len + j->len / 2 + 100;      // Half as much again, so few reallocs for big JSON
+   if (len < j->ptr + n + 100)
+      len = j->ptr + n + 100;
+   if ((!j->alloc && !j->arena) || !(j->buf = jo_buf_realloc (j, len)))
    {
-      j->err = (j->alloc ? "Cannot allocate space" : "Out of space");
-      return;
+      j->err = (j->alloc || j->arena ? "Cannot allocate space" : "Out of space");
+      return 0;
    }
+   j->len = len;
+   return 1;
+}
+
+static inline void
+jo_store (jo_t j, uint8_t c)
+{                               // Write out byte
+   if (!jo_space (j, 1))
+      return;
    j->buf[j->ptr] = c;
    j->null = (c ? 0 : 1);
    j->lt = (c == '<' ? 1 : 0);
@@ -92,6 +347,18 @@ jo_write (jo_t j, uint8_t c)
       j->ptr++;
 }
 
+static void
+jo_append (jo_t j, const void *src, size_t n)
+{                               // Write bytes and advance
+   if (!n || !jo_space (j, n))
+      return;
+   memcpy (j->buf + j->ptr, src, n);
+   j->ptr += n;
+   uint8_t c = ((const uint8_t *) src)[n - 1];
+   j->null = (c ? 0 : 1);
+   j->lt = (c == '<' ? 1 : 0);
+}
+
 jo_t
 jo_pad (jo_t * jp, int n)
 {                               // Ensure padding available
@@ -100,12 +367,21 @@ jo_pad (jo_t * jp, int n)
    jo_t j = *jp;
    if (!j->parse)
       n += j->level + 1;        // Allow space to close and null
-   if (!j->alloc
-       || ((j->parse || j->ptr + n > j->len) && !(j->buf = saferealloc (j->buf, j->len = (j->parse ? j->len : j->ptr) + n))))
+   if (!j->alloc && (!j->arena || j->parse))
    {                            // Cannot pad
       jo_free (jp);
       return NULL;
    }
+   if (j->parse || j->ptr + n > j->len)
+   {
+      size_t len = (j->parse ? j->len : j->ptr) + n;
+      if (!(j->buf = jo_buf_realloc (j, len)))
+      {                         // Cannot pad
+         jo_free (jp);
+         return NULL;
+      }
+      j->len = len;
+   }
    return j;
 }
 
@@ -210,19 +486,31 @@ jo_read_str (jo_t j)
 
 jo_t
 jo_parse_str (const char *buf)
+{                               // Start parsing a null terminated JSON object string
+   return jo_parse_str_in (NULL, buf);
+}
+
+jo_t
+jo_parse_str_in (jo_cursor_t * c, const char *buf)
 {                               // Start parsing a null terminated JSON object string
    if (!buf)
       return NULL;
-   jo_t j = jo_parse_mem (buf, strlen (buf) + 1);       // Include the null so we set null tag
+   jo_t j = jo_parse_mem_in (c, buf, strlen (buf) + 1); // Include the null so we set null tag
    return j;
 }
 
 jo_t
 jo_parse_mem (const void *buf, size_t len)
+{                               // Start parsing a JSON string in memory - does not need a null
+   return jo_parse_mem_in (NULL, buf, len);
+}
+
+jo_t
+jo_parse_mem_in (jo_cursor_t * c, const void *buf, size_t len)
 {                               // Start parsing a JSON string in memory - does not need a null
    if (!buf)
       return NULL;              // No buf
-   jo_t j = jo_new ();
+   jo_t j = jo_new (c);
    if (!j)
       return j;                 // malloc fail
    j->parse = 1;
@@ -239,7 +527,13 @@ jo_parse_mem (const void *buf, size_t len)
 jo_t
 jo_create_mem (void *buf, size_t len)
 {                               // Start creating JSON in memory at buf, max space len.
-   jo_t j = jo_new ();
+   return jo_create_mem_in (NULL, buf, len);
+}
+
+jo_t
+jo_create_mem_in (jo_cursor_t * c, void *buf, size_t len)
+{                               // Start creating JSON in memory at buf, max space len.
+   jo_t j = jo_new (c);
    if (!j)
       return j;                 // malloc fail
    j->buf = buf;
@@ -250,7 +544,13 @@ jo_create_mem (void *buf, size_t len)
 jo_t
 jo_create_alloc (void)
 {                               // Start creating JSON in memory, allocating space as needed.
-   jo_t j = jo_new ();
+   return jo_create_alloc_in (NULL);
+}
+
+jo_t
+jo_create_alloc_in (jo_cursor_t * c)
+{                               // Start creating JSON in memory, allocating space as needed.
+   jo_t j = jo_new (c);
    if (!j)
       return j;                 // malloc fail
    j->alloc = 1;
@@ -260,22 +560,57 @@ jo_create_alloc (void)
 jo_t
 jo_object_alloc (void)
 {                               // Common
-   jo_t j = jo_create_alloc ();
+   return jo_object_alloc_in (NULL);
+}
+
+jo_t
+jo_object_alloc_in (jo_cursor_t * c)
+{                               // Common
+   jo_t j = jo_create_alloc_in (c);
    jo_object (j, NULL);
    return j;
 }
 
-static jo_t
-jo_link (jo_t j)
-{                               // Internal use: Copy control without copying the allocated content - copied object has to stay valid
-   if (!j || j->err)
-      return NULL;              // No j
-   jo_t n = jo_new ();
-   if (!n)
-      return n;                 // malloc fail
-   memcpy (n, j, sizeof (*j));
+jo_t
+jo_parse_str_arena (jo_arena_t a, const char *buf)
+{                               // Start parsing a null terminated JSON object string, cursor in arena
+   if (!buf)
+      return NULL;
+   return jo_parse_mem_arena (a, buf, strlen (buf) + 1);        // Include the null so we set null tag
+}
+
+jo_t
+jo_parse_mem_arena (jo_arena_t a, const void *buf, size_t len)
+{                               // Start parsing a JSON string in memory, cursor in arena
+   jo_cursor_t *c = jo_arena_alloc (a, sizeof (*c));
+   if (!c || !buf)
+      return NULL;
+   return jo_arena_set (jo_parse_mem_in (c, buf, len), a);
+}
+
+jo_t
+jo_create_arena (jo_arena_t a)
+{                               // Start creating JSON in arena, cursor and buffer
+   jo_cursor_t *c = jo_arena_alloc (a, sizeof (*c));
+   if (!c)
+      return NULL;
+   return jo_arena_set (jo_new (c), a);
+}
+
+jo_t
+jo_object_arena (jo_arena_t a)
+{                               // Common
+   jo_t j = jo_create_arena (a);
+   jo_object (j, NULL);
+   return j;
+}
+
+static inline void
+jo_link (jo_t j, jo_t n)
+{                               // Internal use: Copy control to local (stack) cursor, sharing buffer and index - j has to stay valid, and n is not freed
+   *n = *j;
    n->alloc = 0;
-   return n;
+   n->indexing = 0;             // Not building index for link, as not freed
 }
 
 jo_t
@@ -283,14 +618,25 @@ jo_copy (jo_t j)
 {                               // Copy object - copies the object, and if allocating memory, makes copy of the allocated memory too
    if (!j || j->err)
       return NULL;              // No j
-   jo_t n = jo_new ();
+   jo_cursor_t *c = NULL;
+   if (j->arena && !(c = jo_arena_alloc (j->arena, sizeof (*c))))
+      return NULL;              // Arena full
+   jo_t n = jo_new (c);
    if (!n)
       return n;                 // malloc fail
    memcpy (n, j, sizeof (*j));
-   if (j->alloc && j->buf)
+   n->index = NULL;             // Built again if needed
+   n->indexing = (j->indexing || j->index);
+   n->stack = (c ? 1 : 0);      // Copy is always malloc'd, or in the arena
+   n->head = 0;                 // Any copy of buf has no head room
+   if (j->shared)
+   {                            // Already shared (jo_parse_shared), so another reference rather than a copy
+      jo_shared_ref (JO_SHARED (j));
+      n->null = 1;
+   } else if ((j->alloc || (j->arena && !j->parse)) && j->buf)
    {
       j->null = 0;
-      n->buf = mallocspi (j->parse ? j->len + 1 : j->len ? : 1);
+      n->buf = jo_malloc (j, j->parse ? j->len + 1 : j->len ? : 1);
       if (!n->buf)
       {
          jo_free (&n);
@@ -315,6 +661,8 @@ jo_rewind (jo_t j)
       return NULL;
    if (!j->parse)
    {                            // Finish, if possible
+      if (j->cbor && !j->err)
+         j->err = "Cannot parse CBOR, use jo_parse_cbor";
       while (j->level)
          jo_close (j);
       jo_store (j, 0);
@@ -328,6 +676,8 @@ jo_rewind (jo_t j)
    j->comma = 0;
    j->level = 0;
    j->tagok = 0;
+   if (j->insitu)
+      j->err = "Decoded in situ, cannot parse again";
    if (!j->null)
       return NULL;
    return j->buf;
@@ -346,7 +696,7 @@ jo_error (jo_t j, int *pos)
 {                               // Return NULL if no error, else returns an error string.
    if (pos)
       *pos = (j ? j->ptr : -1);
-   if (j && !j->err && !j->parse && !j->alloc && j->ptr + j->level + 1 > j->len)
+   if (j && !j->err && !j->parse && !j->alloc && !j->arena && j->ptr + j->level + 1 > j->len)
       return "No space to finish JSON";
    if (!j)
       return "No j";
@@ -363,8 +713,10 @@ jo_free (jo_t * jp)
       return;
    *jp = NULL;
    if (j->alloc && j->buf)
-      free (j->buf);
-   free (j);
+      free (j->buf - j->head);
+   if (j->shared)
+      jo_shared_free (&(jo_shared_t) { JO_SHARED (j) });
+   jo_del (j);
 }
 
 int
@@ -391,11 +743,13 @@ jo_finish (jo_t * jp)
       jo_store (j, 0);
    }
    char *res = j->buf;
-   if (j->err || j->alloc)
+   if (j->err || j->alloc || j->shared)
       res = NULL;
    if (!res && j->alloc && j->buf)
-      free (j->buf);
-   free (j);
+      free (j->buf - j->head);
+   if (j->shared)
+      jo_shared_free (&(jo_shared_t) { JO_SHARED (j) });
+   jo_del (j);
    return res;
 }
 
@@ -404,6 +758,21 @@ jo_finisha (jo_t * jp)
 {                               // Finish creating allocated JSON, returns start of alloc'd memory if no error.
    // Frees j. If NULL returned then any allocated space also freed
    // It is an error to use with non jo_create_alloc
+   size_t head,
+     len;
+   char *res = jo_finish_head (jp, &head, &len);
+   if (res && head)
+      memmove (res, res + head, len + 1);       // Move down over head room, with null
+   return res;
+}
+
+char *
+jo_finish_head (jo_t * jp, size_t * headp, size_t * lenp)
+{                               // As jo_finisha, but the JSON is *headp in to the allocation returned, after the head room, and is *lenp long
+   if (headp)
+      *headp = 0;
+   if (lenp)
+      *lenp = 0;
    if (!jp)
       return NULL;
    jo_t j = *jp;
@@ -420,11 +789,144 @@ jo_finisha (jo_t * jp)
    if (j->err || !j->alloc)
       res = NULL;
    if (!res && j->alloc && j->buf)
-      free (j->buf);
-   free (j);
+      free (j->buf - j->head);
+   if (res)
+   {
+      res -= j->head;
+      if (headp)
+         *headp = j->head;
+      if (lenp)
+         *lenp = (j->parse ? j->len : j->ptr);
+   }
+   jo_del (j);
    return res;
 }
 
+void
+jo_head (jo_t j, int head)
+{                               // Set head room in front of allocated JSON
+   if (!j || j->err || j->parse || (!j->alloc && !j->arena) || head < 0 || head > 255 || head == j->head)
+      return;
+   if (j->buf && head > j->head)
+   {                            // More
+      char *m = jo_realloc (j, j->buf - j->head, j->head + j->len, head + j->len);
+      if (!m)
+      {
+         j->buf = NULL;
+         j->err = "Cannot allocate space";
+         return;
+      }
+      memmove (m + head, m + j->head, j->ptr);
+      j->buf = m + head;
+   } else if (j->buf)
+   {                            // Less
+      memmove (j->buf - j->head + head, j->buf, j->ptr);
+      j->buf -= j->head - head;
+      j->len += j->head - head;
+   }
+   j->head = head;
+}
+
+static jo_shared_t
+jo_share_buf (jo_t j)
+{                               // Make the allocated buffer of a finished or parse cursor in to a jo_shared_t (adds space for it after the JSON)
+   size_t len = (j->parse ? j->len : j->ptr);
+   if (j->err || !j->alloc || !j->buf || len >= 0xFFFFFFFF)
+      return NULL;
+   if (j->head)
+   {                            // Shared JSON is at the start of the allocation
+      memmove (j->buf - j->head, j->buf, len);
+      j->buf -= j->head;
+      if (!j->parse)
+         j->len += j->head;
+      j->head = 0;
+   }
+   char *buf = realloc (j->buf, JO_SHARED_OFF (len) + sizeof (struct jo_shared_s));
+   if (!buf)
+      return NULL;              // Leaves j as is
+   j->buf = buf;
+   j->buf[len] = 0;
+   jo_shared_t s = (void *) (j->buf + JO_SHARED_OFF (len));
+   s->refs = 1;
+   s->len = len;
+   j->alloc = 0;                // The buffer now belongs to s
+   return s;
+}
+
+jo_shared_t
+jo_share (jo_t * jp)
+{                               // Finish allocated JSON in to an immutable reference counted buffer, frees j
+   if (!jp)
+      return NULL;
+   jo_t j = *jp;
+   if (!j)
+      return NULL;
+   jo_shared_t s = NULL;
+   if (!j->parse)
+   {
+      while (j->level)
+         jo_close (j);
+      jo_store (j, 0);
+   }
+   if (j->shared)
+      s = jo_shared_ref (JO_SHARED (j));
+   else
+      s = jo_share_buf (j);
+   jo_free (jp);
+   return s;
+}
+
+jo_shared_t
+jo_shared_ref (jo_shared_t s)
+{                               // Add a reference
+   if (s)
+      __atomic_add_fetch (&s->refs, 1, __ATOMIC_RELAXED);
+   return s;
+}
+
+void
+jo_shared_free (jo_shared_t * sp)
+{                               // Drop a reference
+   if (!sp)
+      return;
+   jo_shared_t s = *sp;
+   if (!s)
+      return;
+   *sp = NULL;
+   if (!__atomic_sub_fetch (&s->refs, 1, __ATOMIC_ACQ_REL))
+      free ((void *) jo_shared_json (s));
+}
+
+const char *
+jo_shared_json (jo_shared_t s)
+{                               // The JSON (null terminated)
+   if (!s)
+      return NULL;
+   return (char *) s - JO_SHARED_OFF (s->len);
+}
+
+size_t
+jo_shared_len (jo_shared_t s)
+{                               // Length of the JSON
+   if (!s)
+      return 0;
+   return s->len;
+}
+
+jo_t
+jo_parse_shared (jo_shared_t s)
+{                               // Parse shared JSON, holding a reference until jo_free
+   if (!s)
+      return NULL;
+   jo_t j = jo_parse_mem (jo_shared_json (s), s->len);
+   if (!j)
+      return j;                 // malloc fail
+   j->shared = 1;
+   j->null = 1;
+   jo_shared_ref (s);
+   return j;
+}
+
 int
 jo_len (jo_t j)
 {                               // Return length, including any closing
@@ -438,6 +940,162 @@ jo_len (jo_t j)
 // Creating
 // Note that tag is required if in an object and must be null if not
 
+void
+jo_cbor (jo_t j)
+{                               // Create CBOR instead of JSON
+   if (!j || j->err)
+      return;
+   if (j->parse || j->ptr)
+      j->err = "CBOR must be set before creating";
+   else
+      j->cbor = 1;
+}
+
+static void
+jo_cbor_head (jo_t j, uint8_t major, uint64_t v)
+{                               // CBOR major type and argument
+   uint8_t h[9];
+   int n = 1;
+   if (v < 24)
+      *h = (major << 5) + v;
+   else if (v < 0x100)
+   {
+      *h = (major << 5) + 24;
+      h[n++] = v;
+   } else if (v < 0x10000)
+   {
+      *h = (major << 5) + 25;
+      h[n++] = v >> 8;
+      h[n++] = v;
+   } else if (v < 0x100000000ULL)
+   {
+      *h = (major << 5) + 26;
+      for (int s = 24; s >= 0; s -= 8)
+         h[n++] = v >> s;
+   } else
+   {
+      *h = (major << 5) + 27;
+      for (int s = 56; s >= 0; s -= 8)
+         h[n++] = v >> s;
+   }
+   jo_append (j, h, n);
+}
+
+static void
+jo_cbor_int (jo_t j, int64_t v)
+{                               // CBOR integer
+   if (v < 0)
+      jo_cbor_head (j, 1, -1 - v);
+   else
+      jo_cbor_head (j, 0, v);
+}
+
+static int
+jo_cbor_digits (jo_t j, const char *v, int n)
+{                               // CBOR integer from JSON integer literal of n characters, exact, returns 0 if not integer or out of range
+   int neg = (n && *v == '-'),
+      i = neg;
+   if (i == n)
+      return 0;
+   uint64_t m = 0;
+   for (; i < n; i++)
+   {
+      if (v[i] < '0' || v[i] > '9' || m > (UINT64_MAX - (v[i] - '0')) / 10)
+         return 0;              // Not integer, or over UINT64_MAX
+      m = m * 10 + v[i] - '0';
+   }
+   if (!neg || !m)
+      jo_cbor_head (j, 0, m);   // Up to UINT64_MAX
+   else if (m - 1 > INT64_MAX)
+      return 0;                 // Below INT64_MIN
+   else
+      jo_cbor_head (j, 1, m - 1);
+   return 1;
+}
+
+static void
+jo_cbor_float (jo_t j, double v)
+{                               // CBOR number, integer if exact, else float if exact, else double
+   if (v >= -9223372036854775808.0 && v < 9223372036854775808.0 && v == (int64_t) v)
+   {
+      jo_cbor_int (j, v);
+      return;
+   }
+   uint8_t h[9];
+   int n = 1;
+   float f = v;
+   if (f == v)
+   {
+      uint32_t u;
+      memcpy (&u, &f, sizeof (u));
+      *h = 0xFA;
+      for (int s = 24; s >= 0; s -= 8)
+         h[n++] = u >> s;
+   } else
+   {
+      uint64_t u;
+      memcpy (&u, &v, sizeof (u));
+      *h = 0xFB;
+      for (int s = 56; s >= 0; s -= 8)
+         h[n++] = u >> s;
+   }
+   jo_append (j, h, n);
+}
+
+static int isutf8 (const char *s, int n);
+
+static void
+jo_cbor_str (jo_t j, const char *s, size_t len)
+{                               // CBOR text string, invalid UTF-8 bytes taken as latin-1, as JSON does
+   const uint8_t *p = (const uint8_t *) s,
+      *e = p + len;
+   size_t n = 0;
+   for (const uint8_t * q = p; q < e;)
+   {
+      int l = isutf8 ((const char *) q, e - q);
+      q += (l ? : 1);
+      n += (l ? : 2);
+   }
+   jo_cbor_head (j, 3, n);
+   if (n == len)
+   {
+      jo_append (j, s, len);
+      return;
+   }
+   while (p < e)
+   {
+      int l = isutf8 ((const char *) p, e - p);
+      if (l)
+         jo_append (j, p, l);
+      else
+      {
+         jo_write (j, 0xC0 + (*p >> 6));
+         jo_write (j, 0x80 + (*p & 0x3F));
+      }
+      p += (l ? : 1);
+   }
+}
+
+static void
+jo_cbor_lit (jo_t j, const char *lit)
+{                               // CBOR from JSON literal
+   if (!strcmp (lit, "true"))
+      jo_write (j, 0xF5);
+   else if (!strcmp (lit, "false"))
+      jo_write (j, 0xF4);
+   else if (!strcmp (lit, "null"))
+      jo_write (j, 0xF6);
+   else if (!jo_cbor_digits (j, lit, strlen (lit)))
+   {
+      char *end = NULL;
+      double v = strtod (lit, &end);
+      if (!end || *end || end == lit || isnan (v))
+         j->err = "Bad literal for CBOR";
+      else
+         jo_cbor_float (j, v);
+   }
+}
+
 static void
 jo_write_char (jo_t j, uint32_t c)
 {
@@ -486,27 +1144,59 @@ isutf8 (const char *s, int n)
 static void
 jo_write_str (jo_t j, const char *s, ssize_t len)
 {
-   jo_write (j, '"');
    if (len < 0)
       len = strlen (s);
-   while (len)
+   if (j && j->cbor)
    {
-      int l = isutf8 (s, len);
-      if (!l)
-      {                         // Not valid UTF8, write as escaped so obvious, but if you read this back it escapes to unicode, which is technically iffy, but better than just an error
-         jo_write (j, '\\');
+      jo_cbor_str (j, s, len);
+      return;
+   }
+   if (j && j->alloc)
+      jo_space (j, len + 2);    // Usually all we need
+   jo_write (j, '"');
+   const uint8_t *p = (const uint8_t *) s,
+      *e = p + len;
+   while (p < e && !j->err)
+   {                            // Note, lt is always clear at start of a run as follows " or an escape
+      const uint8_t *q = p;
+      while (q < e)
+      {                         // Find run that needs no escaping, to write in one go
+         if (JO_ALIGNED (q) && q + sizeof (jo_word_t) <= e && (q == p || q[-1] != '<'))
+         {                      // Word at a time, stop at control, ", \, <, or top bit set
+            jo_word_t w = *(const jo_word_t *) q;
+            if (!(((w - JO_WORD (0x20)) & ~w & JO_WORD (0x80)) || (w & JO_WORD (0x80)) || JO_ZERO (w ^ JO_WORD ('"'))
+                  || JO_ZERO (w ^ JO_WORD ('\\')) || JO_ZERO (w ^ JO_WORD ('<'))))
+            {
+               q += sizeof (w);
+               continue;
+            }
+         }
+         if (*q >= 0x80)
+         {                      // Valid UTF-8 as is
+            int l = isutf8 ((const char *) q, e - q);
+            if (l < 2)
+               break;
+            q += l;
+         } else if (*q < ' ' || *q == '"' || *q == '\\' || (*q == '/' && q > p && q[-1] == '<'))
+            break;              // escape / is optional, but we always do after < to avoid </script>
+         else
+            q++;
+      }
+      jo_append (j, p, q - p);
+      if (q == e)
+         break;
+      p = q;
+      if (*p >= 0x80)
+      {                         // Not valid UTF8, write as escaped so obvious, but if you read this back it escapes to unicode, which is technically iffy, but better than just an error
+         jo_write (j, '\\');
          jo_write (j, 'u');
          jo_write (j, '0');
          jo_write (j, '0');
-         jo_write (j, JO_BASE16[(*s >> 4) & 0xF]);
-         jo_write (j, JO_BASE16[*s & 0xF]);
-         s++;
-         len--;
-         continue;
-      }
-      len -= l;
-      while (l--)
-         jo_write_char (j, *s++);
+         jo_write (j, JO_BASE16[(*p >> 4) & 0xF]);
+         jo_write (j, JO_BASE16[*p & 0xF]);
+         p++;
+      } else
+         jo_write_char (j, *p++);
    }
    jo_write (j, '"');
 }
@@ -528,6 +1218,12 @@ jo_write_check (jo_t j, const char *tag)
       return (j->err = "tag in non object");
    if (!j->level && j->ptr)
       return (j->err = "second value at top level");
+   if (j->cbor)
+   {                            // No commas or colons
+      if (tag)
+         jo_cbor_str (j, tag, strlen (tag));
+      return j->err;
+   }
    if (j->comma)
       jo_write (j, ',');
    j->comma = 1;
@@ -539,6 +1235,67 @@ jo_write_check (jo_t j, const char *tag)
    return j->err;
 }
 
+static void
+jo_cbor_json (jo_t j, const char *buf, size_t len, uint8_t in)
+{                               // Add JSON value as CBOR, or if in, the content of the JSON object
+   struct jo_s link = { 0 };
+   jo_t p = &link;
+   p->parse = 1;
+   p->buf = (char *) buf;
+   p->len = len;
+   jo_type_t t = jo_here (p);
+   if (in)
+      t = jo_next (p);          // In to object
+   int level = p->level;
+   while (t != JO_END && !j->err)
+   {
+      if (t == JO_CLOSE)
+      {
+         if (p->level <= level)
+            break;              // End of object content
+         jo_write (j, 0xFF);
+      } else if (t == JO_OBJECT)
+         jo_write (j, 0xBF);
+      else if (t == JO_ARRAY)
+         jo_write (j, 0x9F);
+      else if (t == JO_NULL)
+         jo_write (j, 0xF6);
+      else if (t == JO_TRUE)
+         jo_write (j, 0xF5);
+      else if (t == JO_FALSE)
+         jo_write (j, 0xF4);
+      else
+      {
+         const char *v;
+         ssize_t n = jo_view (p, &v);
+         if (n < 0)
+            break;
+         if (t == JO_NUMBER)
+         {
+            if (!v || !jo_cbor_digits (j, v, n))
+               jo_cbor_float (j, jo_read_float (p));
+         } else
+         {                      // Tag or string
+            jo_cbor_head (j, 3, n);
+            if (v)
+               jo_append (j, v, n);
+            else if (jo_space (j, n + 1))
+            {                   // Decode direct in to buffer
+               jo_strncpy (p, j->buf + j->ptr, n + 1);
+               j->ptr += n;
+            }
+         }
+      }
+      t = jo_next (p);
+      if (!in && p->level == level)
+         break;                 // Done the value
+   }
+   if (!in)
+      jo_here (p);              // Check nothing more
+   if (p->err && !j->err)
+      j->err = p->err;
+}
+
 void
 jo_json (jo_t j, const char *tag, jo_t json)
 {                               // Add JSON, if NULL tag, and in object, and JSON is object, add its content
@@ -557,11 +1314,24 @@ jo_json (jo_t j, const char *tag, jo_t json)
       *e = p + json->ptr;
    if (json->parse)
       e = p + json->len;
-   if (!tag && p && *p == '{' && j->level && (j->o[(j->level - 1) / 8] & (1 << ((j->level - 1) & 7))))
+   if (json->cbor && !j->cbor)
+   {
+      if (!j->err)
+         j->err = "Cannot add CBOR to JSON";
+      return;
+   }
+   if (j->cbor && !json->cbor)
+   {                            // Convert
+      uint8_t in = (!tag && p && *p == '{' && j->level && (j->o[(j->level - 1) / 8] & (1 << ((j->level - 1) & 7))));
+      if (in || !jo_write_check (j, tag))
+         jo_cbor_json (j, p, e - p, in);
+      return;
+   }
+   if (!tag && p && (uint8_t) * p == (j->cbor ? 0xBF : '{') && j->level && (j->o[(j->level - 1) / 8] & (1 << ((j->level - 1) & 7))))
    {                            // Special case of adding in-line object content
       p++;
       e--;
-      if (j->comma)
+      if (j->comma && !j->cbor)
          jo_write (j, ',');
       j->comma = 1;
    } else
@@ -578,6 +1348,11 @@ jo_lit (jo_t j, const char *tag, const char *lit)
 {                               // Add literal
    if (jo_write_check (j, tag))
       return;
+   if (j->cbor)
+   {
+      jo_cbor_lit (j, lit);
+      return;
+   }
    while (*lit)
       jo_write (j, *lit++);
 }
@@ -595,7 +1370,7 @@ jo_array (jo_t j, const char *tag)
    j->o[j->level / 8] &= ~(1 << (j->level & 7));
    j->level++;
    j->comma = 0;
-   jo_write (j, '[');
+   jo_write (j, j->cbor ? 0x9F : '[');  // CBOR indefinite length, as we do not know the length yet
 }
 
 void
@@ -612,7 +1387,7 @@ jo_object (jo_t j, const char *tag)
    j->o[j->level / 8] |= (1 << (j->level & 7));
    j->level++;
    j->comma = 0;
-   jo_write (j, '{');
+   jo_write (j, j->cbor ? 0xBF : '{');
 }
 
 void
@@ -626,7 +1401,7 @@ jo_close (jo_t j)
    }
    j->level--;
    j->comma = 1;
-   jo_write (j, (j->o[j->level / 8] & (1 << (j->level & 7))) ? '}' : ']');
+   jo_write (j, j->cbor ? 0xFF : (j->o[j->level / 8] & (1 << (j->level & 7))) ? '}' : ']');
 }
 
 void
@@ -674,43 +1449,166 @@ jo_litf (jo_t j, const char *tag, const char *format, ...)
    jo_lit (j, tag, temp);
 }
 
+static uint8_t
+jo_base_group (uint8_t bits)
+{                               // Bytes per group of whole characters, e.g. 3 for base64 (4 characters)
+   int g = bits,
+      b = 8;
+   while (b)
+   {                            // GCD
+      int t = g % b;
+      g = b;
+      b = t;
+   }
+   return bits / g;
+}
+
 void
 jo_baseN (jo_t j, const char *tag, const void *src, size_t slen, uint8_t bits, const char *alphabet)
 {                               // base 16/32/64 binary to string
    if (jo_write_check (j, tag))
       return;
-   jo_write (j, '"');
-   unsigned int i = 0,
-      b = 0,
-      v = 0;
-   while (i < slen)
-   {
-      b += 8;
-      v = (v << 8) + ((uint8_t *) src)[i++];
-      while (b >= bits)
+   if (j->cbor && ((bits == 6 && alphabet == JO_BASE64) || (bits == 4 && alphabet == JO_BASE16)))
+   {                            // Byte string, tagged as expecting base64/base16 for JSON
+      jo_cbor_head (j, 6, bits == 6 ? 22 : 23);
+      jo_cbor_head (j, 2, slen);
+      jo_append (j, src, slen);
+      return;
+   }
+   uint8_t g = jo_base_group (bits),
+      chars = g * 8 / bits;
+   size_t n = (slen + g - 1) / g * chars;       // Characters, including padding
+   if (j->cbor)
+      jo_cbor_head (j, 3, n);   // Text string
+   else
+      jo_write (j, '"');
+   if (n && jo_space (j, n))
+   {                            // Whole groups at a time, straight in to buffer
+      const uint8_t *s = src;
+      uint8_t *o = (uint8_t *) j->buf + j->ptr;
+      const uint8_t mask = (1 << bits) - 1;
+      while (slen)
       {
-         b -= bits;
-         jo_write (j, alphabet[(v >> b) & ((1 << bits) - 1)]);
-      }
-   }
-   if (b)
-   {                            // final bits
-      b += 8;
-      v <<= 8;
-      b -= bits;
-      jo_write (j, alphabet[(v >> b) & ((1 << bits) - 1)]);
-      while (b)
-      {                         // padding
-         while (b >= bits)
+         uint64_t v = 0;
+         int used = chars;
+         if (slen >= g)
          {
-            b -= bits;
-            jo_write (j, '=');
+            for (int k = 0; k < g; k++)
+               v = (v << 8) + *s++;
+            slen -= g;
+         } else
+         {                      // Final bits, and padding
+            used = (slen * 8 + bits - 1) / bits;
+            for (int k = 0; k < g; k++)
+               v = (v << 8) + (k < slen ? *s++ : 0);
+            slen = 0;
          }
-         if (b)
-            b += 8;
+         for (int k = chars; k--; v >>= bits)
+            o[k] = (k < used ? alphabet[v & mask] : '=');
+         o += chars;
       }
+      j->ptr += n;
+      j->null = 0;
+      j->lt = (o[-1] == '<' ? 1 : 0);
    }
-   jo_write (j, '"');
+   if (!j->cbor)
+      jo_write (j, '"');
+}
+
+static const char jo_digits2[] =
+   "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+   "40414243444546474849505152535455565758596061626364656667686970717273747576777879" "8081828384858687888990919293949596979899";
+
+static int64_t
+jo_days (int y, unsigned m, unsigned d)
+{                               // Days since 1970-01-01 from civil date (proleptic Gregorian, H. Hinnant's algorithm)
+   y -= (m <= 2);
+   int era = (y >= 0 ? y : y - 399) / 400;
+   unsigned yoe = y - era * 400;
+   unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+   unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+   return (int64_t) era *146097 + doe - 719468;
+}
+
+static void
+jo_civil (int64_t z, int *yp, unsigned *mp, unsigned *dp)
+{                               // Civil date from days since 1970-01-01
+   z += 719468;
+   int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+   unsigned doe = z - era * 146097;
+   unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+   unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+   unsigned m = (5 * doy + 2) / 153;
+   *dp = doy - (153 * m + 2) / 5 + 1;
+   *mp = (m < 10 ? m + 3 : m - 9);
+   *yp = yoe + era * 400 + (*mp <= 2);
+}
+
+void
+jo_datetime_us (jo_t j, const char *tag, int64_t us, uint8_t places, int offset)
+{                               // ISO datetime, with places of fractional seconds, and offset (minutes) from UTC
+   if (us < 1000000000LL * 1000000LL || offset <= -24 * 60 || offset >= 24 * 60)
+   {
+      jo_null (j, tag);
+      return;
+   }
+   int64_t s = us / 1000000 + offset * 60;
+   uint32_t f = us % 1000000,
+      secs = s % 86400;
+   int y;
+   unsigned m,
+     d;
+   jo_civil (s / 86400, &y, &m, &d);
+   if (y > 9999)
+   {
+      jo_null (j, tag);
+      return;
+   }
+   char temp[40],
+    *p = temp;
+   void two (unsigned v, char c)
+   {                            // Two digits, and separator
+      memcpy (p, jo_digits2 + v * 2, 2);
+      p += 2;
+      if (c)
+         *p++ = c;
+   }
+   two (y / 100, 0);
+   two (y % 100, '-');
+   two (m, '-');
+   two (d, 'T');
+   two (secs / 3600, ':');
+   two (secs / 60 % 60, ':');
+   two (secs % 60, 0);
+   if (places)
+   {                            // Fraction (truncated)
+      if (places > 6)
+         places = 6;
+      *p++ = '.';
+      two (f / 10000, 0);
+      two (f / 100 % 100, 0);
+      two (f % 100, 0);
+      p -= 6 - places;
+   }
+   if (!offset)
+      *p++ = 'Z';
+   else
+   {
+      *p++ = (offset < 0 ? '-' : '+');
+      if (offset < 0)
+         offset = -offset;
+      two (offset / 60, ':');
+      two (offset % 60, 0);
+   }
+   if (jo_write_check (j, tag))
+      return;
+   if (j->cbor)
+      jo_cbor_head (j, 3, p - temp);
+   else
+      jo_write (j, '"');
+   jo_append (j, temp, p - temp);
+   if (!j->cbor)
+      jo_write (j, '"');
 }
 
 void
@@ -719,12 +1617,7 @@ jo_datetime (jo_t j, const char *tag, time_t t)
    if (t < 1000000000)
       jo_null (j, tag);
    else
-   {
-      struct tm tm;
-      gmtime_r (&t, &tm);
-      jo_stringf (j, tag, "%04d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
-                  tm.tm_sec);
-   }
+      jo_datetime_us (j, tag, (int64_t) t * 1000000, 0, 0);
 }
 
 ssize_t
@@ -735,23 +1628,64 @@ jo_strncpyd (jo_t j, void *dstv, size_t dlen, uint8_t bits, const char *alphabet
       return -1;
    if (jo_peek (j) != '"')
       return -1;                // Not a string
-   jo_t p = jo_link (j);
+   const uint8_t *dec = (alphabet == JO_BASE64 && bits == 6 ? jo_dec64 : alphabet == JO_BASE32 && bits == 5 ? jo_dec32 : alphabet
+                         == JO_BASE16 && bits == 4 ? jo_dec16 : NULL);
+   uint8_t temp[128];
+   if (!dec)
+   {                            // Other alphabet, make table
+      for (int c = 0; c < 128; c++)
+      {
+         const char *q = (c ? strchr (alphabet, bits < 6 ? toupper (c) : c) : NULL);
+         temp[c] = (q && c != '"' && c != '\\' ? q - alphabet + 1 : 0);
+      }
+      dec = temp;
+   }
+   struct jo_s link;
+   jo_t p = &link;
+   jo_link (j, p);
    jo_read (p);                 // skip "
+   uint8_t g = jo_base_group (bits),
+      chars = g * 8 / bits;
+   unsigned int v = 0;
    int b = 0,
-      v = 0,
       c,
       ptr = 0;
-   while ((c = jo_read_str (p)) >= 0 && c != '=')
+   while (1)
    {
-      char *q = strchr (alphabet, bits < 6 ? toupper (c) : c);
-      if (!c || !q)
+      if (!b)
+      {                         // Whole groups at a time, straight from buffer, until anything else (escape, space, padding, end)
+         const uint8_t *s = (uint8_t *) p->buf + p->ptr,
+            *e = (uint8_t *) p->buf + p->len;
+         while (e - s >= chars)
+         {
+            uint64_t w = 0;
+            int k;
+            for (k = 0; k < chars && s[k] < 0x80 && dec[s[k]]; k++)
+               w = (w << bits) + dec[s[k]] - 1;
+            if (k < chars)
+               break;
+            s += chars;
+            for (k = g; k--; w >>= 8)
+               if (dst && ptr + k < dlen)
+                  dst[ptr + k] = w;
+            ptr += g;
+         }
+         p->ptr = s - (uint8_t *) p->buf;
+      }
+      if ((c = jo_read_str (p)) < 0 || c == '=')
+         break;
+      const char *q;
+      if (c < 0x80 && dec[c])
+         c = dec[c] - 1;
+      else if (dec == temp && (c == '"' || c == '\\') && (q = strchr (alphabet, c)))
+         c = q - alphabet;      // Escaped, in other alphabet
+      else
       {                         // Bad character
          if (!c || isspace (c))
             continue;           // space
-         jo_free (&p);
          return -1;             // Bad
       }
-      v = (v << bits) + (q - alphabet);
+      v = (v << bits) + c;
       b += bits;
       if (b >= 8)
       {                         // output byte
@@ -761,46 +1695,592 @@ jo_strncpyd (jo_t j, void *dstv, size_t dlen, uint8_t bits, const char *alphabet
          ptr++;
       }
    }
-   jo_free (&p);
    return ptr;
 }
 
 char *
 jo_strdup (jo_t j)
-{                               // Malloc copy of string
+{                               // Malloc copy of string (or in arena)
+   return jo_strdup_arena (j, j ? j->arena : NULL);
+}
+
+char *
+jo_strdup_arena (jo_t j, jo_arena_t a)
+{                               // Copy of string in arena (malloc if NULL)
    ssize_t len = jo_strlen (j);
    if (len < 0)
       return NULL;
-   char *str = mallocspi (len + 1);
-   jo_strncpy (j, str, len + 1);
+   char *str = (a ? jo_arena_alloc (a, len + 1) : mallocspi (len + 1));
+   if (str)
+      jo_strncpy (j, str, len + 1);
    return str;
 }
 
 char *
 jo_strdupj (jo_t j)
-{                               // Malloc copy of whole JSON object
-   jo_t p = jo_link (j);
+{                               // Malloc copy of whole JSON object (or in arena)
+   return jo_strdupj_arena (j, j ? j->arena : NULL);
+}
+
+char *
+jo_strdupj_arena (jo_t j, jo_arena_t a)
+{                               // Copy of whole JSON value in arena (malloc if NULL)
+   if (!j || !j->parse || j->err)
+      return NULL;
+   struct jo_s link;
+   jo_t p = &link;
+   jo_link (j, p);
    ssize_t start = p->ptr;
    jo_skip (p);
    ssize_t end = p->ptr;
    if (p->err)
       end = start - 1;
-   jo_free (&p);
    while (end > start && (j->buf[end - 1] == ',' || isspace ((int) (unsigned char) (j->buf[end - 1]))))
       end--;
    ssize_t len = end - start;
    if (len < 0)
       return NULL;
-   char *str = mallocspi (len + 1);
+   char *str = (a ? jo_arena_alloc (a, len + 1) : mallocspi (len + 1));
+   if (!str)
+      return str;
    memcpy (str, j->buf + j->ptr, len);
    str[len] = 0;
    return str;
 }
 
+static char *
+jo_utoa (char *e, uint64_t v)
+{                               // Write decimal digits of v ending at e, two at a time, returns start
+   while (v >> 32)
+   {                            // 64 bit divide is slow on 32 bit targets, so only while we must
+      uint32_t r = v % 100;
+      v /= 100;
+      e -= 2;
+      memcpy (e, jo_digits2 + r * 2, 2);
+   }
+   uint32_t w = v;
+   while (w >= 100)
+   {
+      uint32_t r = w % 100;
+      w /= 100;
+      e -= 2;
+      memcpy (e, jo_digits2 + r * 2, 2);
+   }
+   if (w >= 10)
+   {
+      e -= 2;
+      memcpy (e, jo_digits2 + w * 2, 2);
+   } else
+      *--e = '0' + w;
+   return e;
+}
+
+static void
+jo_lit_int (jo_t j, const char *tag, int64_t val, uint8_t places)
+{                               // Add integer, with decimal point places from the right
+   if (j && j->cbor)
+   {
+      if (jo_write_check (j, tag))
+         return;
+      if (places)
+      {                         // Decimal fraction [-places,val]
+         jo_cbor_head (j, 6, 4);
+         jo_cbor_head (j, 4, 2);
+         jo_cbor_int (j, -places);
+      }
+      jo_cbor_int (j, val);
+      return;
+   }
+   char temp[30],
+    *e = temp + sizeof (temp) - 1,
+      *p;
+   *e = 0;
+   uint64_t u = (val < 0 ? -(uint64_t) val : val);
+   if (places)
+   {
+      uint64_t s = 1;
+      for (int n = places; n; n--)
+         s *= 10;
+      p = jo_utoa (e, u % s);
+      while (p > e - places)
+         *--p = '0';
+      *--p = '.';
+      p = jo_utoa (p, u / s);
+   } else
+      p = jo_utoa (e, u);
+   if (val < 0)
+      *--p = '-';
+   jo_lit (j, tag, p);
+}
+
 void
 jo_int (jo_t j, const char *tag, int64_t val)
 {                               // Add an integer
-   jo_litf (j, tag, "%lld", val);
+   jo_lit_int (j, tag, val, 0);
+}
+
+// Round trip double to decimal, Grisu2 (Florian Loitsch), shortest in all but a very few cases, with cached powers 10^(-348+8i)
+static const uint64_t jo_pow10_f[] = {
+   0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+   0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+   0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+   0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+   0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+   0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+   0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+   0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+   0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+   0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+   0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+   0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+   0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+   0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+   0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+   0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+   0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+   0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+   0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+   0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+   0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+   0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t jo_pow10_e[] = {
+   -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874, -847, -821,
+   -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449, -422, -396,
+   -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+   56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+   481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+   907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+typedef struct
+{
+   uint64_t f;
+   int e;
+} jo_fp_t;
+
+static jo_fp_t
+jo_fp_mul (jo_fp_t x, jo_fp_t y)
+{                               // Top 64 bits of product, rounded
+   uint64_t a = x.f >> 32,
+      b = x.f & 0xFFFFFFFF,
+      c = y.f >> 32,
+      d = y.f & 0xFFFFFFFF;
+   uint64_t ac = a * c,
+      bc = b * c,
+      ad = a * d,
+      bd = b * d;
+   uint64_t t = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF) + (1U << 31);
+   return (jo_fp_t)
+   {
+   ac + (ad >> 32) + (bc >> 32) + (t >> 32), x.e + y.e + 64};
+}
+
+static int
+jo_grisu2 (double v, char *buf, int *kp)
+{                               // Digits of positive finite non zero v in buf, returns count, value is digits * 10^*kp
+   uint64_t u;
+   memcpy (&u, &v, sizeof (u));
+   jo_fp_t w = { u & 0xFFFFFFFFFFFFFULL, (u >> 52) & 0x7FF };
+   if (w.e)
+   {
+      w.f += 1ULL << 52;
+      w.e -= 1075;
+   } else
+      w.e = -1074;
+   // Boundaries, half way to neighbours
+   jo_fp_t p = { (w.f << 1) + 1, w.e - 1 },
+      m;
+   while (!(p.f & (1ULL << 53)))
+   {
+      p.f <<= 1;
+      p.e--;
+   }
+   p.f <<= 10;
+   p.e -= 10;
+   if (w.f == 1ULL << 52)
+      m = (jo_fp_t)
+   {
+   (w.f << 2) - 1, w.e - 2};
+   else
+      m = (jo_fp_t)
+   {
+   (w.f << 1) - 1, w.e - 1};
+   m.f <<= m.e - p.e;
+   m.e = p.e;
+   while (!(w.f & (1ULL << 63)))
+   {
+      w.f <<= 1;
+      w.e--;
+   }
+   // Cached power to bring in to range
+   double dk = (-61 - p.e) * 0.30102999566398114 + 347;
+   int k = (int) dk;
+   if (dk - k > 0.0)
+      k++;
+   int i = (k >> 3) + 1;
+   *kp = -(-348 + i * 8);
+   jo_fp_t c = { jo_pow10_f[i], jo_pow10_e[i] };
+   w = jo_fp_mul (w, c);
+   p = jo_fp_mul (p, c);
+   m = jo_fp_mul (m, c);
+   m.f++;
+   p.f--;
+   // Digit generation
+   static const uint64_t pow10[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+      1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+      1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+   };
+   uint64_t delta = p.f - m.f,
+      wp_w = p.f - w.f,
+      one = 1ULL << -p.e;
+   uint32_t p1 = p.f >> -p.e;
+   uint64_t p2 = p.f & (one - 1);
+   int len = 0,
+      kappa = 1;
+   while (kappa < 10 && p1 >= pow10[kappa])
+      kappa++;
+   void round (uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+   {                            // Move last digit closer to w
+      while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+      {
+         buf[len - 1]--;
+         rest += ten_kappa;
+      }
+   }
+   while (kappa > 0)
+   {
+      uint32_t d = p1 / pow10[kappa - 1];
+      p1 %= pow10[kappa - 1];
+      if (d || len)
+         buf[len++] = '0' + d;
+      kappa--;
+      uint64_t t = ((uint64_t) p1 << -p.e) + p2;
+      if (t <= delta)
+      {
+         *kp += kappa;
+         round (t, pow10[kappa] << -p.e, wp_w);
+         return len;
+      }
+   }
+   while (1)
+   {
+      p2 *= 10;
+      delta *= 10;
+      uint32_t d = p2 >> -p.e;
+      if (d || len)
+         buf[len++] = '0' + d;
+      p2 &= one - 1;
+      kappa--;
+      if (p2 < delta)
+      {
+         *kp += kappa;
+         round (p2, one, -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+         return len;
+      }
+   }
+}
+
+void
+jo_float (jo_t j, const char *tag, double val)
+{                               // Add a number, shortest that reads back as the same double
+   if (isnan (val) || isinf (val))
+   {
+      jo_null (j, tag);
+      return;
+   }
+   if (j && j->cbor)
+   {
+      if (!jo_write_check (j, tag))
+         jo_cbor_float (j, val);
+      return;
+   }
+   char temp[32],
+    *o = temp;
+   if (signbit (val))
+   {
+      val = -val;
+      if (val)
+         *o++ = '-';
+   }
+   if (!val)
+   {
+      jo_lit (j, tag, "0");
+      return;
+   }
+   char d[20];
+   int k,
+     n = jo_grisu2 (val, d, &k),
+      p = n + k;                // Decimal point position
+   if (k >= 0 && p <= 21)
+   {                            // Integer
+      memcpy (o, d, n);
+      o += n;
+      while (k--)
+         *o++ = '0';
+   } else if (p > 0 && p <= 21)
+   {                            // d.ddd
+      memcpy (o, d, p);
+      o += p;
+      *o++ = '.';
+      memcpy (o, d + p, n - p);
+      o += n - p;
+   } else if (p > -6 && p <= 0)
+   {                            // 0.000ddd
+      *o++ = '0';
+      *o++ = '.';
+      while (p++ < 0)
+         *o++ = '0';
+      memcpy (o, d, n);
+      o += n;
+   } else
+   {                            // d.ddde-x
+      *o++ = *d;
+      if (n > 1)
+      {
+         *o++ = '.';
+         memcpy (o, d + 1, n - 1);
+         o += n - 1;
+      }
+      *o++ = 'e';
+      if (--p < 0)
+      {
+         *o++ = '-';
+         p = -p;
+      }
+      char e[4],
+       *x = jo_utoa (e + sizeof (e), p);
+      memcpy (o, x, e + sizeof (e) - x);
+      o += e + sizeof (e) - x;
+   }
+   *o = 0;
+   jo_lit (j, tag, temp);
+}
+
+void
+jo_fixed (jo_t j, const char *tag, double val, uint8_t places)
+{                               // Add a number with fixed decimal places, as %.*f
+   if (isnan (val) || isinf (val))
+   {
+      jo_null (j, tag);
+      return;
+   }
+   if (places > 15)
+      places = 15;
+   double s = 1;
+   for (int n = places; n; n--)
+      s *= 10;
+   double a = fabs (val),
+      v = a * s;
+   if (v >= 4503599627370496.0)
+   {                            // Too big for places to matter
+      jo_float (j, tag, val);
+      return;
+   }
+   double r = floor (v),
+      f = v - r,                // Fraction (exact)
+      e = fma (a, s, -v);       // Error in a * s, too small to move f across 0.5 unless f is 0.5
+   if (f > 0.5 || (f == 0.5 && (e > 0 || (!e && fmod (r, 2)))))
+      r++;                      // Round as the exact value would, half even, as printf
+   jo_lit_int (j, tag, val < 0 ? -r : r, places);       // Never -0, unlike printf
+}
+
+jo_t
+jo_parse_cbor (const void *buf, size_t len)
+{                               // Convert CBOR to JSON, and start parsing it
+   if (!buf)
+      return NULL;
+   jo_t j = jo_create_alloc ();
+   if (!j)
+      return j;
+   const uint8_t *p = buf,
+      *e = p + len;
+   void bad (const char *err)
+   {
+      if (!j->err)
+         j->err = err;
+   }
+   uint64_t arg (uint8_t ai)
+   {                            // Argument for additional information ai
+      if (ai < 24)
+         return ai;
+      int n = (ai == 24 ? 1 : ai == 25 ? 2 : ai == 26 ? 4 : ai == 27 ? 8 : 0);
+      if (!n || e - p < n)
+      {
+         bad ("Bad CBOR");
+         return 0;
+      }
+      uint64_t v = 0;
+      while (n--)
+         v = (v << 8) + *p++;
+      return v;
+   }
+   int64_t integer (void)
+   {                            // Integer item
+      if (p >= e || *p >= 0x40)
+      {
+         bad ("Expected CBOR integer");
+         return 0;
+      }
+      uint8_t major = *p >> 5;
+      uint64_t v = arg (*p++ & 31);
+      if (v > INT64_MAX)
+         bad ("CBOR integer too big");
+      return major ? -1 - (int64_t) v : (int64_t) v;
+   }
+   void item (const char *tag)
+   {                            // Add an item
+      if (j->err)
+         return;
+      uint64_t sem = -1;        // Semantic tag
+      uint8_t major = 0,
+         ai = 0;
+      while (1)
+      {
+         if (p >= e)
+         {
+            bad ("Truncated CBOR");
+            return;
+         }
+         major = *p >> 5;
+         ai = *p++ & 31;
+         if (major != 6)
+            break;
+         sem = arg (ai);
+      }
+      if (ai == 31 && major != 4 && major != 5 && major != 7)
+      {
+         bad ("Indefinite length CBOR string not supported");
+         return;
+      }
+      uint64_t v = (ai == 31 ? -1 : arg (ai));
+      if (j->err)
+         return;
+      switch (major)
+      {
+      case 0:                  // Unsigned
+         if (v > INT64_MAX)
+         {
+            char temp[21],
+             *t = jo_utoa (temp + sizeof (temp) - 1, v);
+            temp[sizeof (temp) - 1] = 0;
+            jo_lit (j, tag, t);
+         } else
+            jo_int (j, tag, v);
+         break;
+      case 1:                  // Negative
+         if (v > INT64_MAX)
+            jo_float (j, tag, -1.0 - v);
+         else
+            jo_int (j, tag, -1 - (int64_t) v);
+         break;
+      case 2:                  // Bytes
+      case 3:                  // Text
+         if (v > e - p)
+         {
+            bad ("Truncated CBOR");
+            return;
+         }
+         if (major == 3)
+            jo_stringn (j, tag, (const char *) p, v);
+         else if (sem == 23)
+            jo_base16 (j, tag, p, v);
+         else
+            jo_base64 (j, tag, p, v);
+         p += v;
+         break;
+      case 4:                  // Array
+         if (sem == 4 && v == 2)
+         {                      // Decimal fraction
+            int64_t x = integer (),
+               m = integer ();
+            if (j->err)
+               return;
+            if (x <= 0 && x >= -18)
+               jo_lit_int (j, tag, m, -x);
+            else
+               jo_float (j, tag, m * pow (10, x));
+            break;
+         }
+         jo_array (j, tag);
+         while (!j->err && (ai == 31 ? (p < e && *p != 0xFF) : v--))
+            item (NULL);
+         if (ai == 31 && p++ >= e)
+            bad ("Truncated CBOR");
+         jo_close (j);
+         break;
+      case 5:                  // Map
+         jo_object (j, tag);
+         while (!j->err && (ai == 31 ? (p < e && *p != 0xFF) : v--))
+         {                      // Tag needs to be a null terminated string
+            char temp[65],
+             *key = temp;
+            if (p >= e)
+               bad ("Truncated CBOR");
+            else if ((*p >> 5) == 3 && (*p & 31) != 31)
+            {                   // Text
+               uint64_t l = arg (*p++ & 31);
+               if (l > e - p)
+                  bad ("Truncated CBOR");
+               else if (l >= sizeof (temp) && !(key = mallocspi (l + 1)))
+                  bad ("Cannot allocate CBOR key");
+               else
+               {
+                  memcpy (key, p, l);
+                  key[l] = 0;
+                  p += l;
+               }
+            } else
+            {                   // Integer, as decimal
+               int64_t n = integer ();
+               key = jo_utoa (temp + sizeof (temp) - 1, n < 0 ? -(uint64_t) n : n);
+               if (n < 0)
+                  *--key = '-';
+               temp[sizeof (temp) - 1] = 0;
+            }
+            item (key);
+            if (key && (key < temp || key >= temp + sizeof (temp)))
+               free (key);
+         }
+         if (ai == 31 && p++ >= e)
+            bad ("Truncated CBOR");
+         jo_close (j);
+         break;
+      case 7:                  // Simple and float
+         if (ai == 20)
+            jo_bool (j, tag, 0);
+         else if (ai == 21)
+            jo_bool (j, tag, 1);
+         else if (ai == 22 || ai == 23)
+            jo_null (j, tag);   // null or undefined
+         else if (ai == 25)
+         {                      // Half
+            int x = (v >> 10) & 0x1F,
+               m = v & 0x3FF;
+            double d = (!x ? ldexp (m, -24) : x < 31 ? ldexp (m + 1024, x - 25) : NAN);
+            jo_float (j, tag, (v & 0x8000) ? -d : d);
+         } else if (ai == 26)
+         {
+            float f;
+            uint32_t u = v;
+            memcpy (&f, &u, sizeof (f));
+            jo_float (j, tag, f);
+         } else if (ai == 27)
+         {
+            double d;
+            memcpy (&d, &v, sizeof (d));
+            jo_float (j, tag, d);
+         } else
+            bad ("Unexpected CBOR simple value");
+         break;
+      }
+   }
+   item (NULL);
+   if (p < e)
+      bad ("Extra data after CBOR");
+   jo_rewind (j);
+   return j;
 }
 
 void
@@ -817,16 +2297,72 @@ jo_null (jo_t j, const char *tag)
 
 // Parsing
 
+static inline const uint8_t *
+jo_run (const uint8_t * q, const uint8_t * e)
+{                               // Skip run of ASCII within a string that needs no decoding, stops at ", \, top bit set, or end
+#ifdef	__SSE2__
+   while (q + 16 <= e)
+   {                            // 16 at a time, stop at ", \, or top bit set
+      __m128i v = _mm_loadu_si128 ((const __m128i *) q);
+      if (_mm_movemask_epi8 (_mm_or_si128 (v, _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')),
+                                                            _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\'))))))
+         break;
+      q += 16;
+   }
+#else
+   while (q < e && !JO_ALIGNED (q) && *q < 0x80 && *q != '"' && *q != '\\')
+      q++;
+   while (JO_ALIGNED (q) && q + sizeof (jo_word_t) <= e)
+   {                            // Word at a time, stop at ", \, or top bit set
+      jo_word_t w = *(const jo_word_t *) q;
+      if ((w & JO_WORD (0x80)) || JO_ZERO (w ^ JO_WORD ('"')) || JO_ZERO (w ^ JO_WORD ('\\')))
+         break;
+      q += sizeof (w);
+   }
+#endif
+   while (q < e && *q < 0x80 && *q != '"' && *q != '\\')
+      q++;
+   return q;
+}
+
+static size_t
+jo_plain (jo_t j, uint8_t quoted, uint8_t * all)
+{                               // Length of run of ASCII at ptr that needs no decoding, in string (after the quote) or literal. Sets *all if that is whole value
+   const uint8_t *raw = (const uint8_t *) j->buf + j->ptr,
+      *e = (const uint8_t *) j->buf + j->len,
+      *q = raw;
+   if (quoted)
+      q = jo_run (q, e);
+   else
+      while (q < e && *q > ' ' && *q < 0x80 && *q != ',' && *q != '[' && *q != '{' && *q != ']' && *q != '}')
+         q++;
+   if (all)
+      *all = (quoted ? q < e && *q == '"' : q > raw && (q == e || *q < 0x80));
+   return q - raw;
+}
+
 static inline int
 jo_ws (jo_t j)
 {                               // Skip white space, and return peek at next
-   int c = jo_peek (j);
-   while (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+   if (!j || j->err || !j->parse || j->ptr >= j->len)
+      return -1;
+   const uint8_t *p = (const uint8_t *) j->buf + j->ptr,
+      *e = (const uint8_t *) j->buf + j->len;
+   while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
    {
-      jo_read (j);
-      c = jo_peek (j);
+      p++;
+      while (JO_ALIGNED (p) && p + sizeof (jo_word_t) <= e && *(const jo_word_t *) p == JO_WORD (' '))
+         p += sizeof (jo_word_t);       // Indentation
    }
-   return c;
+   j->ptr = p - (const uint8_t *) j->buf;
+   return p < e ? *p : -1;
+}
+
+static inline void
+jo_digits (jo_t j)
+{                               // Skip digits
+   while (j->ptr < j->len && j->buf[j->ptr] >= '0' && j->buf[j->ptr] <= '9')
+      j->ptr++;
 }
 
 jo_type_t
@@ -868,9 +2404,16 @@ jo_here (jo_t j)
          j->err = "Missing comma";
          return JO_END;
       }
+      size_t comma = j->ptr;
       jo_read (j);
       c = jo_ws (j);
       j->comma = 0;             // Comma consumed
+      if (c < 0 && j->more)
+      {                         // Wait for more, with comma, so we check what follows
+         j->ptr = comma;
+         j->comma = 1;
+         return JO_END;
+      }
    }
    // These are a guess of type - a robust check is done by jo_next
    if (!j->tagok && j->level && (j->o[(j->level - 1) / 8] & (1 << ((j->level - 1) & 7))))
@@ -906,12 +2449,15 @@ jo_next (jo_t j)
    int c;
    if (!j || !j->parse || j->err)
       return JO_END;
-   switch (jo_here (j))
+   jo_type_t t = jo_here (j);
+   switch (t)
    {
    case JO_END:                // End or error
       break;
    case JO_TAG:                // Tag
       jo_read (j);              // "
+      do
+         j->ptr += jo_plain (j, 1, NULL);       // Run needing no decoding, then one escape or UTF-8 character
       while (jo_read_str (j) >= 0);
       if (!j->err && jo_read (j) != '"')
          j->err = "Missing closing quote on tag";
@@ -952,6 +2498,8 @@ jo_next (jo_t j)
       break;
    case JO_STRING:
       jo_read (j);              // "
+      do
+         j->ptr += jo_plain (j, 1, NULL);       // Run needing no decoding, then one escape or UTF-8 character
       while (jo_read_str (j) >= 0);
       if (!j->err && jo_read (j) != '"')
          j->err = "Missing closing quote on string";
@@ -964,16 +2512,14 @@ jo_next (jo_t j)
       if ((c = jo_peek (j)) == '0')
          jo_read (j);           // just zero
       else if (c >= '1' && c <= '9')
-         while ((c = jo_peek (j)) >= '0' && c <= '9')
-            jo_read (j);        // int
+         jo_digits (j);         // int
       if (jo_peek (j) == '.')
       {                         // real
          jo_read (j);
          if ((c = jo_peek (j)) < '0' || c > '9')
             j->err = "Bad real, must be digits after decimal point";
          else
-            while ((c = jo_peek (j)) >= '0' && c <= '9')
-               jo_read (j);     // frac
+            jo_digits (j);      // frac
       }
       if ((c = jo_peek (j)) == 'e' || c == 'E')
       {                         // exp
@@ -983,8 +2529,7 @@ jo_next (jo_t j)
          if ((c = jo_peek (j)) < '0' || c > '9')
             j->err = "Bad exp";
          else
-            while ((c = jo_peek (j)) >= '0' && c <= '9')
-               jo_read (j);     // exp
+            jo_digits (j);      // exp
       }
       j->comma = 1;
       j->tagok = 0;
@@ -1034,7 +2579,9 @@ jo_cpycmp (jo_t j, void *strv, size_t max, uint8_t cmp)
          return 0;              // null==null?
       return 1;                 // str>null
    }
-   jo_t p = jo_link (j);
+   struct jo_s link;
+   jo_t p = &link;
+   jo_link (j, p);
    int c = jo_peek (p);
    ssize_t result = 0;
    void process (int c)
@@ -1054,11 +2601,11 @@ jo_cpycmp (jo_t j, void *strv, size_t max, uint8_t cmp)
          {
             c2 &= 0x07;
             q = 3;
-         } else if (c >= 0xE0)
+         } else if (c2 >= 0xE0)
          {
             c2 &= 0x0F;
             q = 2;
-         } else if (c >= 0xC0)
+         } else if (c2 >= 0xC0)
          {
             c2 &= 0x1F;
             q = 1;
@@ -1103,10 +2650,36 @@ jo_cpycmp (jo_t j, void *strv, size_t max, uint8_t cmp)
       }
    }
    if (c == '"')
-   {                            // String
       jo_read (p);
-      while ((c = jo_read_str (p)) >= 0 && (!cmp || !result))
-         process (c);
+   if (c >= 0 && p->ptr < p->len)
+   {                            // Fast path, initial run of ASCII that needs no decoding, done with memcmp/memcpy
+      const uint8_t *raw = (const uint8_t *) p->buf + p->ptr;
+      size_t n = jo_plain (p, c == '"', NULL);
+      p->ptr += n;
+      if (!cmp)
+      {                         // Copy or count
+         if (str && str < end - 1)
+         {                      // store, but allow for final null always
+            size_t m = (n < end - 1 - str ? n : end - 1 - str);
+            memcpy (str, raw, m);
+            str += m;
+         }
+         result += n;
+      } else if (str && n)
+      {                         // Compare
+         size_t m = (n < end - str ? n : end - str);
+         int r = memcmp (raw, str, m);
+         if (r)
+            result = (r < 0 ? -1 : 1);
+         else if (m < n)
+            result = 1;         // str ended, so str<j
+         str += m;
+      }
+   }
+   if (c == '"')
+   {                            // String
+      while ((c = jo_read_str (p)) >= 0 && (!cmp || !result))
+         process (c);
    } else
    {                            // Literal or number
       while ((c = jo_read (p)) >= 0 && c > ' ' && c != ',' && c != '[' && c != '{' && c != ']' && c != '}' && (!cmp || !result))
@@ -1116,10 +2689,68 @@ jo_cpycmp (jo_t j, void *strv, size_t max, uint8_t cmp)
       *str = 0;                 // Final null...
    if (!result && cmp && str && str < end)
       result = -1;              // j ended, do str>j
-   jo_free (&p);
    return result;
 }
 
+ssize_t
+jo_view (jo_t j, const char **viewp)
+{                               // As jo_strlen, but also point to raw bytes in buffer if no decoding needed
+   if (viewp)
+      *viewp = NULL;
+   if (!j || !j->parse || j->err || j->ptr >= j->len)
+      return -1;
+   uint8_t quoted = (j->buf[j->ptr] == '"'),
+      all = 0;
+   j->ptr += quoted;
+   size_t n = jo_plain (j, quoted, &all);
+   j->ptr -= quoted;
+   if (!all)
+      return jo_strlen (j);     // Needs decoding
+   if (viewp)
+      *viewp = j->buf + j->ptr + quoted;
+   return n;
+}
+
+char *
+jo_strinsitu (jo_t j)
+{                               // Decode string in place, NULL terminated, and move on as jo_next
+   if (!j || !j->parse || j->err || jo_here (j) != JO_STRING)
+      return NULL;
+   if (j->shared)
+   {
+      j->err = "Shared JSON is read only";
+      return NULL;
+   }
+   jo_read (j);                 // "
+   char *str = j->buf + j->ptr,
+      *w = str;
+   int c;
+   j->insitu = 1;
+   while ((c = jo_read_str (j)) >= 0)
+   {                            // Decoded UTF-8 is never longer than the JSON it came from, so w stays behind ptr
+      if (c >= 0x10000)
+      {
+         *w++ = 0xF0 + (c >> 18);
+         *w++ = 0x80 + ((c >> 12) & 0x3F);
+         *w++ = 0x80 + ((c >> 6) & 0x3F);
+      } else if (c >= 0x800)
+      {
+         *w++ = 0xE0 + (c >> 12);
+         *w++ = 0x80 + ((c >> 6) & 0x3F);
+      } else if (c >= 0x80)
+         *w++ = 0xC0 + (c >> 6);
+      *w++ = (c >= 0x80 ? 0x80 + (c & 0x3F) : c);
+   }
+   if (!j->err && jo_read (j) != '"')
+      j->err = "Missing closing quote on string";
+   if (j->err)
+      return NULL;
+   *w = 0;                      // May be where closing quote was
+   j->comma = 1;
+   j->tagok = 0;
+   return str;
+}
+
 ssize_t
 jo_strlen (jo_t j)
 {                               // Return byte length, if a string or tag this is the decoded byte length, else length of literal
@@ -1138,10 +2769,151 @@ jo_strncmp (jo_t j, void *source, size_t max)
    return jo_cpycmp (j, source, max, 1);
 }
 
+static uint32_t
+jo_index_hash (uint32_t up, const char *tag, size_t len)
+{                               // Hash of object entry and tag (FNV-1a)
+   uint32_t h = 2166136261U ^ up;
+   while (len--)
+      h = (h ^ (uint8_t) * tag++) * 16777619U;
+   return h ^ (h >> 16);
+}
+
+static void
+jo_index_build (jo_t j)
+{                               // Build index, in one validating pass from the start, leaving j as is
+   j->indexing = 0;             // Only try once
+   if (!j->parse || j->more || j->index)
+      return;
+   struct jo_s link;
+   jo_t p = &link;
+   jo_link (j, p);
+   jo_rewind (p);
+   uint32_t max = j->len / 8 + 8,
+      tags = 0,
+      open[JO_MAX];
+   jo_index_t *x = jo_malloc (j, sizeof (*x) + max * sizeof (*x->e));
+   if (x)
+      x->count = 0;
+   jo_type_t t = jo_here (p);
+   while (x && t != JO_END)
+   {
+      if (x->count == max)
+      {
+         x = jo_realloc (j, x, sizeof (*x) + max * sizeof (*x->e), sizeof (*x) + max * 2 * sizeof (*x->e));
+         max *= 2;
+         if (!x)
+            break;
+      }
+      uint32_t i = x->count++;
+      x->e[i].pos = p->ptr;
+      x->e[i].skip = i + 1;
+      x->e[i].up = JO_NOTAG;
+      if (t == JO_TAG)
+      {
+         x->e[i].up = open[p->level - 1];
+         tags++;
+      } else if ((t == JO_OBJECT || t == JO_ARRAY) && p->level < JO_MAX)
+         open[p->level] = i;
+      else if (t == JO_CLOSE)
+         x->e[open[p->level - 1]].skip = i + 1;
+      t = jo_next (p);
+   }
+   if (!x)
+      return;                   // No memory, so scan as normal
+   uint32_t count = x->count,
+      size = 1;
+   while (size < tags * 2)
+      size <<= 1;               // Hash table no more than half full
+   if (p->err || p->level || !count
+       || !(x = jo_realloc (j, x, sizeof (*x) + max * sizeof (*x->e), sizeof (*x) + count * sizeof (*x->e) + size * sizeof (*x->hash))))
+   {                            // Only for valid JSON
+      jo_mfree (j, x);
+      return;
+   }
+   x->mask = size - 1;
+   x->hash = (void *) (x->e + count);
+   memset (x->hash, 0, size * sizeof (*x->hash));
+   for (uint32_t i = 0; i < count; i++)
+      if (x->e[i].up != JO_NOTAG)
+      {                         // Add tag to hash table, by its decoded bytes
+         const char *v = j->buf + x->e[i].pos + 1,
+            *e = j->buf + x->e[i + 1].pos;
+         while (*--e != ':');
+         while (*--e != '"');   // End of tag, as valid JSON
+         ssize_t l = e - v;
+         char tag[64];
+         if (memchr (v, '\\', l))
+         {                      // Escaped
+            p->ptr = x->e[i].pos;
+            if ((l = jo_strncpy (p, tag, sizeof (tag))) >= sizeof (tag))
+            {                   // Long escaped tag, not worth having a buffer for, so scan as normal
+               jo_mfree (j, x);
+               return;
+            }
+            v = tag;
+         }
+         uint32_t s = jo_index_hash (x->e[i].up, v, l) & x->mask;
+         while (x->hash[s])
+            s = (s + 1) & x->mask;
+         x->hash[s] = i + 1;
+      }
+   j->index = x;
+}
+
+void
+jo_index (jo_t j)
+{                               // Request index
+   if (j && j->parse && !j->index)
+      j->indexing = 1;
+}
+
+static uint32_t
+jo_index_at (jo_index_t * x, size_t pos)
+{                               // Entry at pos, else count
+   uint32_t l = 0,
+      h = x->count;
+   while (l < h)
+   {
+      uint32_t m = (l + h) / 2;
+      if (x->e[m].pos < pos)
+         l = m + 1;
+      else
+         h = m;
+   }
+   return (l < x->count && x->e[l].pos == pos) ? l : x->count;
+}
+
+static uint32_t
+jo_index_tag (jo_t j, uint32_t up, const char *tag, size_t len)
+{                               // Entry of first tag in object entry up, moving j->ptr, else 0 (never a tag)
+   jo_index_t *x = j->index;
+   for (uint32_t s = jo_index_hash (up, tag, len) & x->mask; x->hash[s]; s = (s + 1) & x->mask)
+   {
+      uint32_t i = x->hash[s] - 1;
+      if (x->e[i].up == up && ((j->ptr = x->e[i].pos), !jo_strncmp (j, (char *) tag, len)))
+         return i;
+   }
+   return 0;
+}
+
 jo_type_t
 jo_skip (jo_t j)
 {                               // Skip to next value at this level
+   if (j && j->indexing)
+      jo_index_build (j);
    jo_type_t t = jo_here (j);
+   uint32_t i;
+   if (t > JO_TAG && j->index && (i = jo_index_at (j->index, j->ptr)) < j->index->count)
+   {                            // Hop to entry after this value
+      i = j->index->e[i].skip;
+      j->comma = 1;
+      j->tagok = 0;
+      if (i >= j->index->count)
+         j->ptr = j->len;       // End
+      else if ((j->ptr = j->index->e[i].pos), j->buf[j->ptr] != '}' && j->buf[j->ptr] != ']')
+         j->comma = 0;          // Next value, so comma already passed
+      return jo_here (j);
+   }
    if (t > JO_CLOSE)
    {
       int l = jo_level (j);
@@ -1152,9 +2924,285 @@ jo_skip (jo_t j)
    return t;
 }
 
+static const uint8_t *
+jo_check_chr (const uint8_t * p, const uint8_t * e, int *cp, const char **errp)
+{                               // As utf8() in jo_read_str, for jo_validate, *cp is -1 at closing quote, end, or error, and value is only exact for \u and UTF-8
+   int c = -1,
+      q = 0;
+   const char *err = NULL;
+   if (p < e && *p != '"')
+   {
+      c = *p++;
+      if (c == '\\')
+      {
+         c = (p < e ? *p++ : -1);
+         if (c == 'u')
+         {
+            c = 0;
+            for (int q = 4; q && !err; q--)
+            {
+               int u = (p < e ? *p++ : -1);
+               if (u >= '0' && u <= '9')
+                  c = (c << 4) + (u & 0xF);
+               else if ((u >= 'A' && u <= 'F') || (u >= 'a' && u <= 'f'))
+                  c = (c << 4) + 9 + (u & 0xF);
+               else
+                  err = "bad hex escape";
+            }
+         } else if (c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' || c == 'n' || c == 'r' || c == 't')
+            c = 0;              // Value not needed
+         else
+            err = "Bad escape";
+      } else if (c >= 0xF7)
+         err = "Bad UTF-8";
+      else if (c >= 0xF0)
+      {
+         c &= 0x07;
+         q = 3;
+      } else if (c >= 0xE0)
+      {
+         c &= 0x0F;
+         q = 2;
+      } else if (c >= 0xC2)
+      {
+         c &= 0x1F;
+         q = 1;
+      } else if (c >= 0xC0)
+         err = "Bad UTF-8";
+      else if (c >= 0x80)
+         err = "Bat UTF-8";
+      while (q-- && !err)
+      {                         // More UTF-8 characters
+         int u = (p < e ? *p++ : -1);
+         if (u < 0x80 || u >= 0xC0)
+            err = "Bad UTF-8";
+         c = (c << 6) + (u & 0x3F);
+      }
+   }
+   if (err)
+   {
+      *errp = err;
+      c = -1;
+   }
+   *cp = c;
+   return p;
+}
+
+static const uint8_t *
+jo_check_str (const uint8_t * p, const uint8_t * e, const char **errp, const char *missing)
+{                               // Rest of string for jo_validate, from where the run needing no decoding stopped, as jo_next would
+   int c;
+   while ((p = jo_check_chr (p, e, &c, errp)), c >= 0)
+   {
+      if (c >= 0xD800 && c <= 0xDBFF)
+      {                         // UTF16 Surrogates
+         p = jo_check_chr (p, e, &c, errp);
+         if (c < 0xDC00 || c > 0xDFFF)
+         {
+            if (!*errp)
+               *errp = "Bad UTF-16, second part invalid";
+            break;
+         }
+      }
+      p = jo_run (p, e);
+   }
+   if (!*errp && (p == e || *p++ != '"'))
+      *errp = missing;
+   return p;
+}
+
+jo_type_t
+jo_validate (jo_t j)
+{                               // As jo_skip, but one tight pass over the raw bytes, checking structure, escapes and depth without decoding
+   if (!j || !j->parse || j->err || j->more || j->index || j->indexing)
+      return jo_skip (j);       // Streaming, use the normal path, or indexed, which hops
+   jo_type_t t = jo_here (j);
+   if (t <= JO_CLOSE)
+      return t;
+   // Errors, and where they are left, must match jo_next/jo_here exactly, so jo_error is the same as with jo_skip
+   const uint8_t *b = (const uint8_t *) j->buf,
+      *p = b + j->ptr,
+      *e = b + j->len;
+   const char *err = NULL;
+   int l = j->level,
+      level = l;
+   uint8_t comma = j->comma,
+      tagok = j->tagok;
+   while (1)
+   {
+      // As jo_next, moving over what is at p
+      uint8_t value = 1;
+      switch (t)
+      {
+      case JO_END:
+         break;
+      case JO_TAG:
+         p = jo_run (p + 1, e);
+         if (p < e && *p == '"')
+            p++;
+         else
+            p = jo_check_str (p, e, &err, "Missing closing quote on tag");
+         if (!err)
+         {
+            while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+               p++;
+            if (p == e || *p++ != ':')
+               err = "Missing colon after tag";
+         }
+         tagok = 1;
+         value = 0;
+         break;
+      case JO_OBJECT:
+      case JO_ARRAY:
+         p++;
+         value = 0;
+         if (level >= JO_MAX)
+         {
+            err = "JSON too deep";
+            break;
+         }
+         if (t == JO_OBJECT)
+            j->o[level / 8] |= (1 << (level & 7));
+         else
+            j->o[level / 8] &= ~(1 << (level & 7));
+         level++;
+         comma = 0;
+         tagok = 0;
+         break;
+      case JO_CLOSE:
+         p++;
+         level--;
+         break;
+      case JO_STRING:
+         p = jo_run (p + 1, e);
+         if (p < e && *p == '"')
+            p++;
+         else
+            p = jo_check_str (p, e, &err, "Missing closing quote on string");
+         break;
+      case JO_NUMBER:
+         if (*p == '-')
+            p++;
+         if (p < e && *p == '0')
+            p++;
+         else
+            while (p < e && *p >= '0' && *p <= '9')
+               p++;
+         if (p < e && *p == '.')
+         {                      // real
+            if (++p == e || *p < '0' || *p > '9')
+               err = "Bad real, must be digits after decimal point";
+            while (p < e && *p >= '0' && *p <= '9')
+               p++;
+         }
+         if (!err && p < e && (*p == 'e' || *p == 'E'))
+         {                      // exp
+            if (++p < e && (*p == '-' || *p == '+'))
+               p++;
+            if (p == e || *p < '0' || *p > '9')
+               err = "Bad exp";
+            while (p < e && *p >= '0' && *p <= '9')
+               p++;
+         }
+         break;
+      case JO_NULL:
+      case JO_TRUE:
+      case JO_FALSE:
+         {
+            const char *s = (t == JO_NULL ? "null" : t == JO_TRUE ? "true" : "false");
+            while (*s && p < e && *p++ == *s)
+               s++;
+            if (*s)
+               err = (t == JO_NULL ? "Misspelled null" : t == JO_TRUE ? "Misspelled true" : "Misspelled false");
+         }
+         break;
+      }
+      if (value)
+      {
+         comma = 1;
+         tagok = 0;
+      }
+      if (err)
+         break;
+      // As jo_here, what is next
+      while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+         p++;
+      if (p == e)
+      {
+         t = JO_END;
+         if (level > l)
+            err = "Unclosed";
+         break;
+      }
+      int c = *p;
+      uint8_t obj = (level && (j->o[(level - 1) / 8] & (1 << ((level - 1) & 7))));
+      if (c == '}' || c == ']')
+      {
+         if (tagok)
+            err = "Missing value";
+         else if (!level)
+            err = "Too many closed";
+         else if (c != (obj ? '}' : ']'))
+            err = "Mismatched close";
+         t = JO_CLOSE;
+      } else
+      {
+         if (comma)
+         {
+            if (!level)
+               err = "Extra value at top level";
+            else if (c != ',')
+               err = "Missing comma";
+            else
+            {
+               p++;
+               while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+                  p++;
+               c = (p < e ? *p : -1);
+               comma = 0;
+            }
+         }
+         if (err)
+            break;
+         if (!tagok && obj)
+         {
+            if (c != '"')
+               err = "Missing tag";
+            t = JO_TAG;
+         } else if (c == '"')
+            t = JO_STRING;
+         else if (c == '{')
+            t = JO_OBJECT;
+         else if (c == '[')
+            t = JO_ARRAY;
+         else if (c == 'n')
+            t = JO_NULL;
+         else if (c == 't')
+            t = JO_TRUE;
+         else if (c == 'f')
+            t = JO_FALSE;
+         else if (c == '-' || (c >= '0' && c <= '9'))
+            t = JO_NUMBER;
+         else
+            err = "Bad JSON";
+      }
+      if (err || level <= l)
+         break;
+   }
+   j->ptr = p - b;
+   j->level = level;
+   j->comma = comma;
+   j->tagok = tagok;
+   if ((j->err = err))
+      return JO_END;
+   return t;
+}
+
 jo_type_t
 jo_find (jo_t j, const char *path)
 {                               // Find a path, JSON path style. Does not do [n] or ['name'] yet
+   if (j && j->indexing)
+      jo_index_build (j);
    jo_rewind (j);
    if (*path == '$')
    {
@@ -1163,6 +3211,38 @@ jo_find (jo_t j, const char *path)
       if (path[1] == '.')
          path += 2;             // We always start from root anyway
    }
+   if (j && j->index && !j->err)
+   {                            // Indexed, so look up each tag in turn, leaving j as the scan below would
+      jo_index_t *x = j->index;
+      uint32_t i = 0;           // Entry of value we are at
+      while (*path && jo_here (j) == JO_OBJECT)
+      {
+         const char *tag = path;
+         while (*path && *path != '.')
+            path++;
+         int len = path - tag;
+         if (*path)
+            path++;
+         uint32_t k = (len == 1 && *tag == '*') ? (j->buf[x->e[i + 1].pos] == '"' ? i + 1 : 0) : jo_index_tag (j, i, tag, len);
+         j->o[j->level / 8] |= (1 << (j->level & 7));
+         j->level++;            // In to object
+         j->tagok = 0;
+         if (!k)
+         {                      // Not found, at close
+            k = x->e[i].skip - 1;
+            j->ptr = x->e[k].pos;
+            j->comma = (k > i + 1);
+            break;
+         }
+         j->ptr = x->e[k].pos;
+         j->comma = 0;
+         jo_type_t t = jo_next (j);
+         if (!*path)
+            return t;           // Found
+         i = k + 1;
+      }
+      return JO_END;
+   }
    while (*path)
    {
       jo_type_t t = jo_here (j);
@@ -1193,6 +3273,144 @@ jo_find (jo_t j, const char *path)
    return JO_END;
 }
 
+int
+jo_find_many (jo_t j, jo_find_t * f, int n)
+{                               // Find several paths, as jo_find, in one pass
+   if (!f || n <= 0)
+      return 0;
+   struct
+   {
+      const char *tag;          // Current path segment
+      uint8_t len;              // Length of segment
+      uint8_t level;            // Level of the object in which tag is looked for
+      uint8_t done:1;           // Found, or cannot be found
+   } s[n];
+   int found = 0,
+      live = 0;
+   void hit (int i, jo_type_t t)
+   {                            // Entry i found at value t
+      s[i].done = 1;
+      live--;
+      f[i].type = t;
+      if (t == JO_END)
+         return;
+      found++;
+      if (f[i].dst && f[i].len)
+      {
+         if (t < JO_STRING || jo_strncpy (j, f[i].dst, f[i].len) < 0)
+            *(char *) f[i].dst = 0;
+      }
+      if (f[i].cb)
+      {                         // Callback has own cursor
+         struct jo_s link;
+         jo_t p = &link;
+         jo_link (j, p);
+         f[i].cb (p, &f[i]);
+      }
+   }
+   void seg (int i, const char *path)
+   {                            // Set path segment
+      s[i].tag = path;
+      while (*path && *path != '.')
+         path++;
+      s[i].len = (path - s[i].tag > 255 ? 255 : path - s[i].tag);
+   }
+   if (j && j->indexing)
+      jo_index_build (j);       // So values not wanted are hopped over
+   jo_rewind (j);
+   jo_type_t t = jo_here (j);
+   for (int i = 0; i < n; i++)
+   {
+      const char *path = f[i].path ? : "";
+      s[i].done = 0;
+      s[i].level = 1;
+      live++;
+      if (*path == '$')
+      {
+         if (!path[1])
+         {
+            hit (i, t);         // root
+            continue;
+         }
+         if (path[1] == '.')
+            path += 2;          // We always start from root anyway
+      }
+      seg (i, path);
+      if (!*path || t != JO_OBJECT)
+         hit (i, JO_END);
+   }
+   if (live && t == JO_OBJECT)
+   {
+      uint8_t first = 1;        // First tag in object, for wildcard
+      t = jo_next (j);
+      while (live && t != JO_END)
+      {
+         int level = jo_level (j);
+         if (t == JO_CLOSE)
+         {                      // Anything still looking in this object is not found
+            for (int i = 0; i < n; i++)
+               if (!s[i].done && s[i].level == level)
+                  hit (i, JO_END);
+            first = 0;
+            t = jo_next (j);
+            continue;
+         }
+         if (t != JO_TAG)
+         {                      // Value not wanted
+            t = jo_skip (j);
+            first = 0;
+            continue;
+         }
+         const char *v;
+         ssize_t vl = jo_view (j, &v);
+         uint8_t matched = 0;
+         for (int i = 0; i < n; i++)
+            if (!s[i].done && s[i].level == level
+                && ((s[i].len == 1 && *s[i].tag == '*' && first)
+                    || (v ? (vl == s[i].len && !memcmp (v, s[i].tag, vl)) : !jo_strncmp (j, (char *) s[i].tag, s[i].len))))
+            {
+               s[i].level = 0;  // Matched, see below
+               matched = 1;
+            }
+         first = 0;
+         t = jo_next (j);       // Value
+         if (!matched)
+         {
+            t = jo_skip (j);
+            continue;
+         }
+         uint8_t in = 0;
+         for (int i = 0; i < n; i++)
+            if (!s[i].done && !s[i].level)
+            {
+               const char *path = s[i].tag + s[i].len;
+               if (*path)
+                  path++;       // .
+               if (!*path)
+                  hit (i, t);   // Found
+               else if (t != JO_OBJECT)
+                  hit (i, JO_END);      // Can only look inside an object
+               else
+               {
+                  seg (i, path);
+                  s[i].level = level + 1;
+                  in = 1;
+               }
+            }
+         if (in)
+         {
+            first = 1;
+            t = jo_next (j);    // In to object
+         } else
+            t = jo_skip (j);
+      }
+   }
+   for (int i = 0; i < n; i++)
+      if (!s[i].done)
+         f[i].type = JO_END;    // Ran out, e.g. bad JSON
+   return found;
+}
+
 const char *
 jo_debug (jo_t j)
 {                               // Debug string
@@ -1216,7 +3434,9 @@ jo_read_int (jo_t j)
    int64_t n = 0,
       c,
       s = 1;
-   jo_t p = jo_link (j);
+   struct jo_s link;
+   jo_t p = &link;
+   jo_link (j, p);
    c = jo_read (p);
    if (c == '-')
    {
@@ -1228,7 +3448,6 @@ jo_read_int (jo_t j)
       n = n * 10 + c - '0';
       c = jo_read (p);
    }
-   jo_free (&p);
    return n * s;
 }
 
@@ -1237,6 +3456,67 @@ jo_read_float (jo_t j)
 {
    if (!j || !j->parse || jo_here (j) != JO_NUMBER)
       return NAN;
+   {                            // Parse in place, exact if up to 15 digits (as fit in double) and 10^22 or less
+      struct jo_s link;
+      jo_t p = &link;
+      jo_link (j, p);
+      static const long double pow10[] =
+         { 1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L,
+         1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L
+      };
+      uint64_t m = 0;
+      int digits = 0,           // Significant digits
+         any = 0,               // Any digits
+         e = 0,
+         c = jo_read (p);
+      uint8_t neg = 0;
+      if (c == '-')
+      {
+         neg = 1;
+         c = jo_read (p);
+      }
+      while (c >= '0' && c <= '9')
+      {
+         m = m * 10 + c - '0';
+         if (m)
+            digits++;
+         any++;
+         c = jo_read (p);
+      }
+      if (c == '.')
+         while ((c = jo_read (p)) >= '0' && c <= '9')
+         {
+            m = m * 10 + c - '0';
+            if (m)
+               digits++;
+            any++;
+            e--;
+         }
+      if (c == 'e' || c == 'E')
+      {
+         int es = 1,
+            x = 0;
+         c = jo_read (p);
+         if (c == '-' || c == '+')
+         {
+            es = (c == '-' ? -1 : 1);
+            c = jo_read (p);
+         }
+         if (c < '0' || c > '9')
+            any = 0;            // Needs exponent digits
+         while (c >= '0' && c <= '9' && x < 1000)
+         {
+            x = x * 10 + c - '0';
+            c = jo_read (p);
+         }
+         e += x * es;
+      }
+      if (any && digits <= 15 && e >= -22 && e <= 22 && (c < 0 || c <= ' ' || c == ',' || c == ']' || c == '}'))
+      {
+         long double value = (e < 0 ? m / pow10[-e] : m * pow10[e]);
+         return neg ? -value : value;
+      }
+   }
    char temp[50];
    ssize_t l = jo_strncpy (j, temp, sizeof (temp));
    if (l <= 0)
@@ -1248,37 +3528,198 @@ jo_read_float (jo_t j)
    return value;
 }
 
-time_t
-jo_read_datetime (jo_t j)
-{                               // Get a datetime
+int64_t
+jo_read_datetime_us (jo_t j)
+{                               // Get a datetime, in microseconds
    if (jo_here (j) != JO_STRING)
       return -1;
-   char dt[21];
-   ssize_t l = jo_strncpy (j, dt, sizeof (dt));
-   if (l != 10 && l != 19 && l != 20)
+   char dt[40];
+   const char *p;
+   ssize_t l = jo_view (j, &p);
+   if (l < 0 || l >= sizeof (dt))
       return -1;
-   int y = 0,
+   if (!p)
+   {                            // Escaped, unlikely
+      jo_strncpy (j, dt, sizeof (dt));
+      p = dt;
+   }
+   const char *e = p + l;
+   int num (int n)
+   {                            // Exactly n digits
+      int v = 0;
+      while (n--)
+      {
+         if (p == e || !isdigit ((int) *p))
+            return -1;
+         v = v * 10 + *p++ - '0';
+      }
+      return v;
+   }
+   int y = num (4),
       m = 0,
       d = 0,
       H = 0,
       M = 0,
-      S = 0;
-   int n = sscanf (dt, "%d-%d-%d%*c%d:%d:%d", &y, &m, &d, &H, &M, &S);
-   if (n != 3 && n != 6)
-      return 1;
-   struct tm tm = {.tm_year = y - 1900,.tm_mon = m - 1,.tm_mday = d,.tm_hour = H,.tm_min = M,.tm_sec = S,.tm_isdst = -1 };
-   time_t t = 0;
-#if 0                           // ESP IDF has no timegm!
-   if (l == 20 && dt[l - 1] == 'Z')
-      t = timegm (&tm);
+      S = 0,
+      offset = 0,
+      zone = 0;
+   uint32_t f = 0;
+   if (y < 0 || p == e || *p++ != '-' || (m = num (2)) < 1 || m > 12 || p == e || *p++ != '-' || (d = num (2)) < 1 || d > 31)
+      return -1;
+   if (p < e && (*p == 'T' || *p == 't' || *p == ' '))
+   {                            // Time
+      p++;
+      if ((H = num (2)) < 0 || H > 23 || p == e || *p++ != ':' || (M = num (2)) < 0 || M > 59)
+         return -1;
+      if (p < e && *p == ':')
+      {                         // Seconds
+         p++;
+         if ((S = num (2)) < 0 || S > 60)
+            return -1;
+         if (p < e && (*p == '.' || *p == ','))
+         {                      // Fraction, to microseconds
+            p++;
+            int n = 0;
+            while (p < e && isdigit ((int) *p))
+            {
+               if (n++ < 6)
+                  f = f * 10 + *p - '0';
+               p++;
+            }
+            if (!n)
+               return -1;
+            while (n++ < 6)
+               f *= 10;
+         }
+      }
+      if (p < e && (*p == 'Z' || *p == 'z'))
+      {
+         p++;
+         zone = 1;
+      } else if (p < e && (*p == '+' || *p == '-'))
+      {                         // Offset, +HH, +HHMM, or +HH:MM
+         int sign = (*p++ == '-' ? -1 : 1),
+            oh = num (2),
+            om = 0;
+         if (oh < 0 || oh > 23)
+            return -1;
+         if (p < e && *p == ':')
+            p++;
+         if ((p < e || p[-1] == ':') && ((om = num (2)) < 0 || om > 59))
+            return -1;
+         offset = sign * (oh * 60 + om);
+         zone = 1;
+      }
+   }
+   if (p != e)
+      return -1;
+   int64_t t;
+   if (zone)
+      t = jo_days (y, m, d) * 86400 + H * 3600 + M * 60 + S - offset * 60;
    else
-      t = timelocal (&tm);
-#else
-   if (l == 20 && dt[l - 1] == 'Z')
-      tm.tm_isdst = 0;
-   t = mktime (&tm);
-#endif
-   return t;
+   {                            // Local time
+      struct tm tm = {.tm_year = y - 1900,.tm_mon = m - 1,.tm_mday = d,.tm_hour = H,.tm_min = M,.tm_sec = S,.tm_isdst = -1 };
+      if ((t = mktime (&tm)) == -1)
+         return -1;             // Not valid local time
+   }
+   return t * 1000000 + f;
+}
+
+time_t
+jo_read_datetime (jo_t j)
+{                               // Get a datetime
+   int64_t us = jo_read_datetime_us (j);
+   if (us == -1)
+      return -1;
+   return (us - (us < 0 ? 999999 : 0)) / 1000000;
+}
+
+static size_t
+jo_query_json (char *out, const char *in, size_t len, size_t *leadp)
+{                               // Query string to JSON object (all as strings), returns length (not including the null stored after)
+   // If out is NULL just works out length. Sets *leadp to how far ahead of in that out must start to convert in place
+   const char *s = in,
+      *e = in + len;
+   size_t o = 0,
+      lead = 0;
+   uint8_t last = 0;
+   void put (uint8_t c)
+   {
+      if (o + 1 > lead + (s - in))
+         lead = o + 1 - (s - in);       // Would overwrite input not yet read
+      if (out)
+         out[o] = c;
+      o++;
+      last = c;
+   }
+   void chr (uint8_t c)
+   {                            // As jo_write_char
+#define esc(a,b) if(c==b){put('\\');put(a);return;}
+      escapes
+#undef esc
+         if (c == '/' && last == '<')
+         put ('\\');
+      if (c < ' ' || c == 0xFF)
+      {
+         put ('\\');
+         put ('u');
+         put ('0');
+         put ('0');
+         put (JO_BASE16[c >> 4]);
+         put (JO_BASE16[c & 0xF]);
+         return;
+      }
+      put (c);
+   }
+   put ('{');
+   while (s < e && *s)
+   {
+      put ('"');
+      while (s < e && *s && *s != '=')
+         chr (*s++);
+      if (s < e && *s)
+         s++;
+      put ('"');
+      put (':');
+      put ('"');                // Do all as strings
+      while (s < e && *s && *s != '&')
+      {
+         int c = *s++;
+         if (c == '+')
+            c = ' ';
+         else if (c == '%' && e - s >= 2 && isxdigit ((int) *s) && isxdigit ((int) s[1]))
+         {
+            c = (*s & 0xF) + (isalpha ((int) *s) ? 9 : 0);
+            s++;
+            c = (c << 4) + (*s & 0xF) + (isalpha ((int) *s) ? 9 : 0);
+            s++;
+         }
+         chr (c);
+      }
+      put ('"');
+      if (s < e && *s)
+         s++;
+      if (s < e && *s)
+         put (',');
+   }
+   put ('}');
+   put (0);
+   if (leadp)
+      *leadp = lead;
+   return o - 1;
+}
+
+static jo_t
+jo_parse_querybuf (char *buf, size_t len)
+{                               // Parse allocated JSON from jo_query_json, owning buf
+   jo_t j = jo_parse_mem (buf, len + 1);
+   if (!j)
+   {
+      free (buf);
+      return NULL;
+   }
+   j->alloc = 1;
+   return j;
 }
 
 jo_t
@@ -1286,39 +3727,171 @@ jo_parse_query (const char *buf)
 {                               // Parse a query string format into a JSON object string (allocated)
    if (!buf)
       return NULL;
-   jo_t j = jo_object_alloc ();
-   if (!j)
-      return j;
-   while (*buf)
-   {
-      jo_write (j, '"');
-      while (*buf && *buf != '=')
-         jo_write_char (j, *buf++);
-      if (*buf)
-         buf++;
-      jo_write (j, '"');
-      jo_write (j, ':');
-      jo_write (j, '"');        // Do all as strings
-      while (*buf && *buf != '&')
+   size_t len = strlen (buf),
+      n = jo_query_json (NULL, buf, len, NULL);
+   char *json = mallocspi (n + 1);
+   if (!json)
+      return NULL;
+   jo_query_json (json, buf, len, NULL);
+   return jo_parse_querybuf (json, n);
+}
+
+jo_t
+jo_parse_query_insitu (char *buf, size_t len)
+{                               // Parse a query string format into a JSON object string, in buf (allocated)
+   if (!buf)
+      return NULL;
+   size_t lead,
+     n = jo_query_json (NULL, buf, len, &lead);
+   if (n + 1 > len + 1 || lead)
+   {                            // Need more space
+      char *m = realloc (buf, n + 1 > lead + len ? n + 1 : lead + len);
+      if (!m)
       {
-         int c = *buf++;
-         if (c == '+')
-            c = ' ';
-         else if (c == '%' && isxdigit ((int) *buf) && isxdigit ((int) buf[1]))
+         free (buf);
+         return NULL;
+      }
+      buf = m;
+      if (lead)
+         memmove (buf + lead, buf, len);
+   }
+   jo_query_json (buf, buf + lead, len, NULL);
+   return jo_parse_querybuf (buf, n);
+}
+
+struct jo_stream_s
+{                               // Streaming parse
+   struct jo_s j;               // Cursor, buf holds data not yet parsed (from ptr to len)
+   size_t max;                  // Size of buf
+   size_t scan;                 // How far we have checked a string that is not yet complete
+   jo_stream_cb_t *cb;          // Callback
+   void *arg;                   // Callback arg
+};
+
+jo_stream_t
+jo_stream (size_t max, jo_stream_cb_t * cb, void *arg)
+{                               // Start a streaming parse
+   jo_stream_t s = mallocspi (sizeof (*s));
+   if (!s)
+      return s;
+   memset (s, 0, sizeof (*s));
+   if (!(s->j.buf = mallocspi (max)))
+   {
+      free (s);
+      return NULL;
+   }
+   s->j.parse = 1;
+   s->j.alloc = 1;
+   s->j.more = 1;
+   s->max = max;
+   s->cb = cb;
+   s->arg = arg;
+   return s;
+}
+
+static void
+jo_stream_parse (jo_stream_t s)
+{                               // Parse all complete tags and values in buf
+   jo_t j = &s->j;
+   const char *b = j->buf;
+   int ws (size_t p)
+   {
+      return b[p] == ' ' || b[p] == '\t' || b[p] == '\r' || b[p] == '\n';
+   }
+   while (!j->err)
+   {                            // Check the next tag or value is all here, as jo_next cannot wait for more part way through
+      size_t p = j->ptr;
+      while (p < j->len && ws (p))
+         p++;
+      if (p < j->len && j->comma && b[p] == ',')
+         for (p++; p < j->len && ws (p); p++);
+      if (p == j->len && j->more)
+         break;                 // Need more
+      if (p == j->len)
+         ;                      // End, jo_here says if OK
+      else if (b[p] == '"')
+      {                         // String or tag, find the end
+         for (p = (s->scan > p ? s->scan : p + 1); p < j->len && b[p] != '"'; p++)
+            if (b[p] == '\\')
+               p++;
+         if (p >= j->len && j->more)
          {
-            c = (*buf & 0xF) + (isalpha ((int) *buf) ? 9 : 0);
-            buf++;
-            c = (c << 4) + (*buf & 0xF) + (isalpha ((int) *buf) ? 9 : 0);
-            buf++;
+            s->scan = p;        // Carry on from here
+            break;              // Need more
          }
-         jo_write_char (j, c);
+         if (!j->tagok && j->level && (j->o[(j->level - 1) / 8] & (1 << ((j->level - 1) & 7))))
+         {                      // Tag, so also need to see the colon
+            for (p++; p < j->len && ws (p); p++);
+            if (p >= j->len && j->more)
+               break;           // Need more
+         }
+      } else if (b[p] != '{' && b[p] != '[' && b[p] != '}' && b[p] != ']')
+      {                         // Number or literal, needs something after it, unless the end
+         while (p < j->len && !ws (p) && b[p] != ',' && b[p] != ']' && b[p] != '}')
+            p++;
+         if (p == j->len && j->more)
+            break;              // Need more
       }
-      jo_write (j, '"');
-      if (*buf)
-         buf++;
-      if (*buf)
-         jo_write (j, ',');
+      jo_type_t t = jo_here (j);
+      if (t == JO_END)
+         break;
+      if (s->cb)
+      {
+         const char *e = s->cb (s->arg, j, t);
+         if (e && !j->err)
+            j->err = e;
+      }
+      jo_next (j);
+      s->scan = 0;
    }
-   jo_close (j);
-   return j;
+   if (j->ptr)
+   {                            // Keep only what is left
+      memmove (j->buf, j->buf + j->ptr, j->len - j->ptr);
+      j->len -= j->ptr;
+      if (s->scan)
+         s->scan -= j->ptr;
+      j->ptr = 0;
+   }
+}
+
+const char *
+jo_stream_data (jo_stream_t s, const void *data, size_t len)
+{                               // Parse next chunk
+   if (!s)
+      return "No stream";
+   jo_t j = &s->j;
+   const uint8_t *d = data;
+   while (len && !j->err)
+   {
+      size_t n = s->max - j->len;
+      if (!n)
+         return (j->err = "Too long for stream");
+      if (n > len)
+         n = len;
+      memcpy (j->buf + j->len, d, n);
+      j->len += n;
+      d += n;
+      len -= n;
+      jo_stream_parse (s);
+   }
+   return j->err;
+}
+
+const char *
+jo_stream_end (jo_stream_t * sp)
+{                               // End of JSON
+   if (!sp || !*sp)
+      return NULL;
+   jo_stream_t s = *sp;
+   *sp = NULL;
+   jo_t j = &s->j;
+   j->more = 0;
+   if (!j->err)
+      jo_stream_parse (s);      // Whatever is left
+   if (!j->err && j->level)
+      j->err = "Unclosed";
+   const char *e = j->err;
+   free (j->buf);
+   free (s);
+   return e;
 }
@@ -0,0 +1,478 @@
+// Host benchmark for the jo JSON toolkit
+// Builds jo.c on Linux against the stand-in headers in host/ (see Makefile, make jo_bench)
+// Corpora are shaped like real traffic: the "up" state message, a settings dump, and Home Assistant discovery config
+// Output is one JSON object per line, per benchmark and corpus, so results can be tracked release to release
+// Usage: jo_bench [-t seconds-per-test] [test/corpus names to run...]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+#include "revk.h"
+
+void *
+mallocspi (size_t size)
+{                               // No SPI RAM on host
+   return malloc (size);
+}
+
+uint32_t
+uptime (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec;
+}
+
+static double
+now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static time_t corpus_ts = 1760700000;   // Fixed so output is reproducible
+
+// Corpora, built with the same jo calls as the library, so building them is also the generate test
+
+static jo_t
+make_up (void)
+{                               // As per the "up" state message from the main task
+   jo_t j = jo_object_alloc ();
+   jo_datetime (j, "ts", corpus_ts);
+   jo_string (j, "id", "30AEA4C7D8E0");
+   jo_bool (j, "up", 1);
+   jo_int (j, "uptime", 3 * 86400 + 1234);
+   jo_int (j, "mqtt-up", 3 * 86400 + 1200);
+   jo_string (j, "app", "Faikin");
+   jo_string (j, "version", "8a2f1c3");
+   jo_string (j, "build-suffix", "-S3-MINI-N4-R2");
+   jo_string (j, "build", "2025-01-02T10:11:12");
+   jo_int (j, "flash", 4194304);
+   jo_int (j, "rst", 1);
+   jo_int (j, "mem", 123456);
+   jo_int (j, "spi", 2045678);
+   jo_string (j, "ssid", "IoT");
+   jo_stringf (j, "bssid", "%02X%02X%02X%02X%02X%02X", 0xE0, 0x63, 0xDA, 0x12, 0x34, 0x56);
+   jo_int (j, "rssi", -61);
+   jo_int (j, "chan", 6);
+   jo_stringf (j, "ipv4", "%d.%d.%d.%d", 192, 168, 1, 123);
+   jo_stringf (j, "ipv6", "%x:%x:%x:%x:%x:%x:%x:%x", 0x2001, 0xdb8, 0x1234, 0, 0x32ae, 0xa4ff, 0xfec7, 0xd8e0);
+   return j;
+}
+
+static jo_t
+make_settings (void)
+{                               // As per revk_setting_dump, including groups, arrays, and a base64 blob
+   jo_t j = jo_object_alloc ();
+   jo_string (j, "hostname", "GuestRoom");
+   jo_string (j, "appname", "Faikin");
+   jo_object (j, "ota");
+   jo_string (j, "host", "ota.revk.uk");
+   jo_int (j, "days", 7);
+   jo_int (j, "start", 600);
+   jo_bool (j, "auto", 1);
+   jo_bool (j, "beta", 0);
+   {                            // Certificate sized blob
+      uint8_t cert[900];
+      for (int i = 0; i < sizeof (cert); i++)
+         cert[i] = (i * 131 + 17) ^ (i >> 3);
+      jo_base64 (j, "cert", cert, sizeof (cert));
+   }
+   jo_close (j);
+   jo_string (j, "ntphost", "pool.ntp.org");
+   jo_string (j, "tz", "GMT+0BST,M3.5.0,M10.5.0");
+   jo_int (j, "watchdogtime", 60);
+   jo_object (j, "topic");
+   jo_array (j, "group");
+   jo_string (j, NULL, "lounge");
+   jo_string (j, NULL, "");
+   jo_close (j);
+   jo_string (j, "command", "command");
+   jo_string (j, "setting", "setting");
+   jo_string (j, "state", "state");
+   jo_string (j, "event", "event");
+   jo_string (j, "info", "info");
+   jo_string (j, "error", "error");
+   jo_string (j, "ha", "homeassistant");
+   jo_close (j);
+   jo_object (j, "prefix");
+   jo_bool (j, "app", 1);
+   jo_bool (j, "host", 0);
+   jo_close (j);
+   jo_array (j, "blink");
+   jo_string (j, NULL, "-38");
+   jo_string (j, NULL, "");
+   jo_string (j, NULL, "");
+   jo_close (j);
+   jo_bool (j, "dark", 0);
+   jo_string (j, "factorygpio", "-21");
+   jo_object (j, "wifi");
+   jo_string (j, "ssid", "IoT");
+   jo_string (j, "pass", "\"quoted\" and \\escaped\\ passphrase\t");
+   jo_string (j, "ip", "");
+   jo_int (j, "reset", 3600);
+   jo_close (j);
+   jo_object (j, "mqtt");
+   jo_array (j, "host");
+   jo_string (j, NULL, "mqtt.iot");
+   jo_string (j, NULL, "");
+   jo_close (j);
+   jo_array (j, "user");
+   jo_string (j, NULL, "device");
+   jo_string (j, NULL, "");
+   jo_close (j);
+   jo_array (j, "port");
+   jo_int (j, NULL, 1883);
+   jo_int (j, NULL, 0);
+   jo_close (j);
+   jo_int (j, "size", 2048);
+   jo_close (j);
+   for (int i = 1; i <= 20; i++)
+   {                            // App settings
+      char tag[16];
+      sprintf (tag, "app%d", i);
+      if (i % 4 == 0)
+         jo_bool (j, tag, i & 8);
+      else if (i % 4 == 1)
+         jo_int (j, tag, i * 1000 - 7);
+      else if (i % 4 == 2)
+         jo_stringf (j, tag, "value %d £ ünïcødé", i);
+      else
+         jo_fixed (j, tag, i * 1.25, 2);
+   }
+   return j;
+}
+
+static jo_t
+make_ha (void)
+{                               // As per ha_config_opts for a sensor
+   jo_t j = jo_object_alloc ();
+   jo_stringf (j, "unique_id", "%s-%s", "GuestRoom", "temp");
+   jo_object (j, "dev");
+   jo_array (j, "ids");
+   jo_string (j, NULL, "30AEA4C7D8E0");
+   jo_close (j);
+   jo_string (j, "name", "GuestRoom");
+   jo_string (j, "mdl", "Faikin");
+   jo_string (j, "sw", "8a2f1c3");
+   jo_string (j, "mf", "www.me.uk");
+   jo_close (j);
+   jo_string (j, "dev_cla", "temperature");
+   jo_string (j, "name", "Temperature");
+   jo_string (j, "stat_t", "state/Faikin/GuestRoom");
+   jo_string (j, "unit_of_meas", "°C");
+   jo_stringf (j, "val_tpl", "{{value_json.%s}}", "temp");
+   jo_string (j, "avty_t", "state/Faikin/GuestRoom");
+   jo_string (j, "avty_tpl", "{{value_json.up}}");
+   jo_bool (j, "pl_avail", 1);
+   jo_bool (j, "pl_not_avail", 0);
+   return j;
+}
+
+static jo_t
+make_log (void)
+{                               // Large payload, a day of logged readings, as a bulk upload or history request
+   jo_t j = jo_object_alloc ();
+   jo_string (j, "id", "30AEA4C7D8E0");
+   jo_array (j, "log");
+   for (int i = 0; i < 288; i++)
+   {
+      jo_object (j, NULL);
+      jo_datetime (j, "ts", corpus_ts + i * 300);
+      jo_litf (j, "temp", "%d.%d", 18 + i % 5, i % 10);
+      jo_int (j, "rh", 40 + i % 20);
+      jo_bool (j, "heat", i & 1);
+      jo_string (j, "note", i % 7 ? "ok" : "Door \"open\", 5°C drop");
+      jo_close (j);
+   }
+   jo_close (j);
+   return j;
+}
+
+typedef struct corpus_s corpus_t;
+struct corpus_s
+{
+   const char *name;
+   jo_t (*make) (void);
+   const char *find[6];         // Typical jo_find paths
+   const char *blob;            // Path of base64 value, if any
+   char *json;
+   size_t len;
+};
+
+static corpus_t corpora[] = {
+   {"up",.make = make_up,.find = {"uptime", "ssid", "rssi", "ipv4", "missing"}},
+   {"settings",.make = make_settings,.find = {"hostname", "ota.host", "wifi.pass", "mqtt.size", "app20"},.blob = "ota.cert"},
+   {"ha",.make = make_ha,.find = {"unique_id", "dev.name", "stat_t", "val_tpl", "pl_not_avail"}},
+   {"log",.make = make_log,.find = {"id", "log", "missing"}},
+};
+
+// Tests, each does one call's worth of work on the corpus, and returns non zero if it failed
+
+static int
+test_generate (corpus_t * c)
+{
+   jo_t j = c->make ();
+   char *json = jo_finisha (&j);
+   if (!json)
+      return 1;
+   free (json);
+   return 0;
+}
+
+static int
+test_next (corpus_t * c)
+{                               // Walk every element
+   jo_t j = jo_parse_mem (c->json, c->len);
+   while (jo_next (j) != JO_END);
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_skip (corpus_t * c)
+{                               // Validate whole payload, as mqtt_rx
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_skip (j);
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_validate (corpus_t * c)
+{                               // As skip, using the fast validator
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_validate (j);
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_find (corpus_t * c)
+{                               // Several lookups on one parsed message, as command and web handlers do
+   jo_t j = jo_parse_mem (c->json, c->len);
+   for (int i = 0; i < sizeof (c->find) / sizeof (*c->find) && c->find[i]; i++)
+      jo_find (j, c->find[i]);
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_findx (corpus_t * c)
+{                               // As find, with structural index
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_index (j);
+   for (int i = 0; i < sizeof (c->find) / sizeof (*c->find) && c->find[i]; i++)
+      jo_find (j, c->find[i]);
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_many (corpus_t * c)
+{                               // As find, all in one pass
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_find_t f[sizeof (c->find) / sizeof (*c->find)];
+   int n = 0;
+   while (n < sizeof (c->find) / sizeof (*c->find) && c->find[n])
+   {
+      f[n] = (jo_find_t) {.path = c->find[n] };
+      n++;
+   }
+   int bad = (!jo_find_many (j, f, n) || jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static const char *
+stream_cb (void *arg, jo_t j, jo_type_t t)
+{
+   if (t == JO_TAG || t == JO_STRING)
+      (*(int *) arg) += jo_strlen (j);
+   return NULL;
+}
+
+static int
+test_stream (corpus_t * c)
+{                               // Streaming parse, in 64 byte chunks as if from recv
+   int n = 0;
+   jo_stream_t s = jo_stream (1500, stream_cb, &n);
+   for (size_t p = 0; p < c->len; p += 64)
+      jo_stream_data (s, c->json + p, c->len - p < 64 ? c->len - p : 64);
+   return jo_stream_end (&s) != NULL || !n;
+}
+
+static int
+test_strncpy (corpus_t * c)
+{                               // Decode every tag and string
+   char temp[2000];
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_type_t t;
+   while ((t = jo_next (j)) != JO_END)
+      if (t == JO_TAG || t == JO_STRING)
+         jo_strncpy (j, temp, sizeof (temp));
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_strdup (corpus_t * c)
+{                               // Allocated copy of every tag and string, as request handlers do
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_type_t t;
+   while ((t = jo_next (j)) != JO_END)
+      if (t == JO_TAG || t == JO_STRING)
+         free (jo_strdup (j));
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_arena (corpus_t * c)
+{                               // As strdup, in an arena, freed in one go
+   jo_arena_t a = jo_arena (1024);
+   jo_t j = jo_parse_mem_arena (a, c->json, c->len);
+   jo_type_t t;
+   while ((t = jo_next (j)) != JO_END)
+      if (t == JO_TAG || t == JO_STRING)
+         jo_strdup (j);
+   int bad = (jo_error (j, NULL) != NULL);
+   jo_arena_free (&a);
+   return bad;
+}
+
+static int
+test_strncpyd (corpus_t * c)
+{                               // Base64 decode
+   uint8_t temp[2000];
+   jo_t j = jo_parse_mem (c->json, c->len);
+   int bad = (jo_find (j, c->blob) != JO_STRING || jo_strncpy64 (j, temp, sizeof (temp)) <= 0);
+   jo_free (&j);
+   return bad;
+}
+
+static int
+test_cbor (corpus_t * c)
+{                               // Convert JSON to CBOR
+   jo_t j = jo_parse_mem (c->json, c->len);
+   jo_t o = jo_create_alloc ();
+   jo_cbor (o);
+   jo_json (o, NULL, j);
+   jo_free (&j);
+   char *cbor = jo_finisha (&o);
+   free (cbor);
+   return !cbor;
+}
+
+typedef struct test_s test_t;
+struct test_s
+{
+   const char *name;
+   int (*test) (corpus_t *);
+   uint8_t blob:1;              // Only if corpus has blob
+};
+
+static const test_t tests[] = {
+   {"generate", test_generate},
+   {"next", test_next},
+   {"skip", test_skip},
+   {"validate", test_validate},
+   {"find", test_find},
+   {"findx", test_findx},
+   {"many", test_many},
+   {"stream", test_stream},
+   {"strncpy", test_strncpy},
+   {"strdup", test_strdup},
+   {"arena", test_arena},
+   {"strncpyd", test_strncpyd,.blob = 1},
+   {"cbor", test_cbor},
+};
+
+static int
+selected (int argc, const char *argv[], const char *test, const char *corpus)
+{                               // If test or corpus named on command line (or nothing named)
+   if (!argc)
+      return 1;
+   for (int i = 0; i < argc; i++)
+      if (!strcmp (argv[i], test) || !strcmp (argv[i], corpus))
+         return 1;
+   return 0;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   double mintime = 0.5;
+   argc--;
+   argv++;
+   if (argc >= 2 && !strcmp (*argv, "-t"))
+   {
+      mintime = strtod (argv[1], NULL);
+      argc -= 2;
+      argv += 2;
+   }
+   if (mintime <= 0)
+      errx (1, "Bad time");
+   for (int c = 0; c < sizeof (corpora) / sizeof (*corpora); c++)
+   {
+      jo_t j = corpora[c].make ();
+      if (!(corpora[c].json = jo_finisha (&j)))
+         errx (1, "Failed to make %s", corpora[c].name);
+      corpora[c].len = strlen (corpora[c].json);
+   }
+   int fails = 0;
+   for (int t = 0; t < sizeof (tests) / sizeof (*tests); t++)
+      for (int c = 0; c < sizeof (corpora) / sizeof (*corpora); c++)
+      {
+         corpus_t *C = &corpora[c];
+         const test_t *T = &tests[t];
+         if ((T->blob && !C->blob) || !selected (argc, argv, T->name, C->name))
+            continue;
+         if (T->test (C))
+         {
+            warnx ("%s/%s failed", T->name, C->name);
+            fails++;
+            continue;
+         }
+         unsigned long calls = 0,
+            batch = 1;
+         double start = now (),
+            elapsed = 0;
+         while (elapsed < mintime)
+         {                      // Batches grow so the clock is not read too often
+            for (unsigned long n = 0; n < batch; n++)
+               T->test (C);
+            calls += batch;
+            if (batch < 1000000)
+               batch *= 2;
+            elapsed = now () - start;
+         }
+         char out[200];
+         jo_t j = jo_create_mem (out, sizeof (out));
+         jo_object (j, NULL);
+         jo_string (j, "test", T->name);
+         jo_string (j, "corpus", C->name);
+         jo_int (j, "bytes", C->len);
+         jo_int (j, "calls", calls);
+         jo_fixed (j, "ns", elapsed * 1e9 / calls, 1);
+         jo_fixed (j, "mbs", C->len * calls / elapsed / 1e6, 2);
+         const char *line = jo_finish (&j);
+         if (line)
+            printf ("%s\n", line);
+         fflush (stdout);
+      }
+   for (int c = 0; c < sizeof (corpora) / sizeof (*corpora); c++)
+      free (corpora[c].json);
+   return fails ? 1 : 0;
+}
@@ -1,6 +1,6 @@
 // Light weight MQTT client
-// QoS 0 only, no queuing or resending (using TCP to do that for us)
-// Live sending to TCP for outgoing messages
+// QoS 0, and QoS 1 publish (if window set) kept and resent on reconnect until acked
+// Live sending to TCP for outgoing messages, or optionally queued
 // Simple callback for incoming messages
 // Automatic reconnect
 static const char __attribute__((unused)) * TAG = "LWMQTT";
@@ -25,6 +25,7 @@ static const char __attribute__((unused)) * TAG = "LWMQTT";
 #include "freertos/semphr.h"
 
 #include "lwip/sockets.h"
+#include <fcntl.h>
 #include "lwip/dns.h"
 #include "lwip/netdb.h"
 
@@ -39,6 +40,18 @@ static const char __attribute__((unused)) * TAG = "LWMQTT";
 #warning MQTT server code is not complete
 #endif
 
+typedef struct lwmqtt_q_s lwmqtt_q_t;
+struct lwmqtt_q_s
+{                               // Queued message
+   lwmqtt_q_t *next;
+   void *ref;                   // For sent callback
+   int len;                     // Frame length
+   int idpos;                   // QoS 1 packet ID position in frame
+   unsigned short id;           // QoS 1 packet ID
+   uint8_t sent:1;              // QoS 1 sent, awaiting PUBACK
+   unsigned char frame[];       // Whole message to send
+};
+
 struct lwmqtt_s
 {                               // mallocd copies
    lwmqtt_callback_t *callback;
@@ -53,6 +66,33 @@ struct lwmqtt_s
    int sock;                    // Connection socket
    unsigned short keepalive;
    unsigned short seq;
+   uint32_t streamlen;          // Payload left to send in streaming publish
+   lwmqtt_sent_t *sent;         // Queued message sent callback
+   SemaphoreHandle_t qmutex;    // queue mutex
+   lwmqtt_q_t *qhead;           // Queue of messages to send
+   lwmqtt_q_t *qtail;
+   unsigned short queue;        // Max queued
+   unsigned short queued;       // Number queued
+   int wake;                    // UDP socket to wake client task when queued
+   lwmqtt_t next;               // List of handles for I/O task
+   int64_t retry;               // When to retry connect (I/O task)
+   unsigned char *rx;           // Receive buffer, kept at high water mark
+   int rxlen;                   // Size of rx
+   int rxstart;                 // Start of current message in rx
+   int rxend;                   // End of data in rx
+   int rxneed;                  // Length needed for current message
+   uint32_t rxmax;              // Max message size to receive
+   uint32_t rxskip;             // Bytes still to discard of a message over rxmax
+   uint32_t ka;                 // Next keep alive
+   uint32_t kacheck;            // Response time check
+   lwmqtt_q_t *qoshead;         // QoS 1 messages, in flight and waiting to send (in qmutex)
+   lwmqtt_q_t *qostail;
+   uint32_t qosmem;             // Max bytes of QoS 1 messages
+   uint32_t qosbytes;           // Bytes of QoS 1 messages
+   unsigned short window;       // Max QoS 1 in flight
+   unsigned short inflight;     // QoS 1 in flight
+   unsigned short qosunsent;    // QoS 1 waiting to send
+   uint8_t *wbuf;               // TLS coalescing buffer when queued (used under mutex)
    uint32_t connecttime;        // Time of connect
    uint8_t backoff:4;           // Reconnect backoff
    uint8_t failed:3;            // Login received error
@@ -67,6 +107,8 @@ struct lwmqtt_s
    uint8_t tlsname_ref:1;       // The buf below is not malloc'd
    uint8_t dnsipv6:1;           // DNS has IPv6
    uint8_t ipv6:1;              // Connection is IPv6
+   uint8_t streaming:1;         // Streaming publish, holding mutex
+   uint8_t queue_old:1;         // Drop oldest when queue full
    void *ca_cert_buf;           // For checking server
    int ca_cert_bytes;
    void *our_cert_buf;          // For auth
@@ -93,6 +135,337 @@ hwrite (lwmqtt_t handle, uint8_t * buf, int len)
    return pos;
 }
 
+#define	LWMQTT_COALESCE	256     // TLS coalescing buffer, so small header segments go in one record
+#define	LWMQTT_RX	1024    // Minimum receive buffer, so several messages can be read at once
+#define	LWMQTT_WBUF	1400    // TLS coalescing buffer when queued, so a TCP segment of small messages go in one record
+#define	LWMQTT_IOV	16      // Queued messages per write
+#define	LWMQTT_QOSMEM	16384   // Default max bytes of QoS 1 messages held
+#define	LWMQTT_RXMAX	65536   // Default max incoming message size
+#define	LWMQTT_MAX	268435455       // Max remaining length (4 byte variable length)
+
+static int
+lwmqtt_varlen (unsigned int n)
+{                               // Bytes for variable length
+   return n < 0x80 ? 1 : n < 0x4000 ? 2 : n < 0x200000 ? 3 : 4;
+}
+
+static unsigned char *
+lwmqtt_varint (unsigned char *p, unsigned int n)
+{                               // Write variable length, returns pointer after it
+   do
+   {
+      *p = (n & 0x7F);
+      if (n >>= 7)
+         *p |= 0x80;
+      p++;
+   }
+   while (n);
+   return p;
+}
+
+static int
+hwritev (lwmqtt_t handle, struct iovec *iov, int n)
+{                               // Send (all of) a set of blocks, without making one buffer of them (iov is changed)
+   int total = 0;
+   if (!handle->tls)
+   {                            // Plain socket, writev
+      while (n)
+      {
+         int sent = lwip_writev (handle->sock, iov, n);
+         if (sent <= 0)
+            return sent;
+         total += sent;
+         while (n && sent >= iov->iov_len)
+         {                      // Done
+            sent -= iov->iov_len;
+            iov++;
+            n--;
+         }
+         if (n)
+         {                      // Partial
+            iov->iov_base = (uint8_t *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+         }
+      }
+      return total;
+   }
+   // TLS, coalesce small segments, as each write is a TLS record
+   uint8_t local[LWMQTT_COALESCE],
+    *b = handle->wbuf ? : local;
+   int size = (handle->wbuf ? LWMQTT_WBUF : sizeof (local));
+   int used = 0;
+   int flush (void)
+   {
+      int sent = hwrite (handle, b, used);
+      if (sent < used)
+         return -1;
+      total += used;
+      used = 0;
+      return 0;
+   }
+   while (n--)
+   {
+      uint8_t *p = iov->iov_base;
+      int len = iov->iov_len;
+      iov++;
+      while (len)
+      {
+         if (!used && len >= size)
+         {                      // Big, send as is
+            if (hwrite (handle, p, len) < len)
+               return -1;
+            total += len;
+            break;
+         }
+         int l = size - used;
+         if (l > len)
+            l = len;
+         memcpy (b + used, p, l);
+         used += l;
+         p += l;
+         len -= l;
+         if (used == size && flush ())
+            return -1;
+      }
+   }
+   if (used && flush ())
+      return -1;
+   return total;
+}
+
+static void
+lwmqtt_queue_fail (lwmqtt_t handle, const char *err)
+{                               // Drop all queued messages
+   if (!handle->qmutex)
+      return;
+   xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+   lwmqtt_q_t *q = handle->qhead;
+   handle->qhead = handle->qtail = NULL;
+   handle->queued = 0;
+   xSemaphoreGive (handle->qmutex);
+   while (q)
+   {
+      lwmqtt_q_t *next = q->next;
+      if (handle->sent)
+         handle->sent (handle->arg, q->ref, err);
+      free (q);
+      q = next;
+   }
+}
+
+static void
+lwmqtt_queue_send (lwmqtt_t handle)
+{                               // Send queued messages (from client task), several at a time
+   xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+   lwmqtt_q_t *q = handle->qhead;
+   handle->qhead = handle->qtail = NULL;
+   handle->queued = 0;
+   xSemaphoreGive (handle->qmutex);
+   const char *err = NULL;
+   while (q)
+   {
+      struct iovec iov[LWMQTT_IOV];
+      int n = 0,
+         total = 0;
+      lwmqtt_q_t *done = q;
+      while (q && n < LWMQTT_IOV)
+      {
+         iov[n].iov_base = q->frame;
+         iov[n].iov_len = q->len;
+         total += q->len;
+         n++;
+         q = q->next;
+      }
+      if (!err)
+      {
+         xSemaphoreTake (handle->mutex, portMAX_DELAY);
+         if (handle->sock < 0)
+            err = "Not connected";
+         else if (hwritev (handle, iov, n) < total)
+            err = "Failed to send";
+         xSemaphoreGive (handle->mutex);
+      }
+      while (done != q)
+      {
+         lwmqtt_q_t *next = done->next;
+         if (handle->sent)
+            handle->sent (handle->arg, done->ref, err);
+         free (done);
+         done = next;
+      }
+   }
+}
+
+static void
+lwmqtt_qos_send (lwmqtt_t handle)
+{                               // Send QoS 1 messages (from client task), up to window in flight
+   int n = LWMQTT_IOV;
+   while (n == LWMQTT_IOV)
+   {
+      struct iovec iov[LWMQTT_IOV];
+      lwmqtt_q_t *qs[LWMQTT_IOV];
+      int total = 0;
+      n = 0;
+      xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+      for (lwmqtt_q_t * q = handle->qoshead; q && n < LWMQTT_IOV && handle->inflight < handle->window; q = q->next)
+         if (!q->sent)
+         {
+            q->sent = 1;
+            handle->inflight++;
+            handle->qosunsent--;
+            qs[n] = q;
+            iov[n].iov_base = q->frame;
+            iov[n].iov_len = q->len;
+            total += q->len;
+            n++;
+         }
+      xSemaphoreGive (handle->qmutex);  // Only client task removes from list, so qs stay valid
+      if (!n)
+         return;
+      xSemaphoreTake (handle->mutex, portMAX_DELAY);
+      for (int i = 0; i < n; i++)
+         if (!qs[i]->id)
+         {                      // Packet ID (seq is shared with subscribe), kept when resent
+            if (!++(handle->seq))
+               handle->seq++;   // Non zero
+            qs[i]->id = handle->seq;
+            qs[i]->frame[qs[i]->idpos] = handle->seq >> 8;
+            qs[i]->frame[qs[i]->idpos + 1] = handle->seq;
+         }
+      int sent = (handle->sock < 0 ? -1 : hwritev (handle, iov, n));
+      xSemaphoreGive (handle->mutex);
+      if (sent < total)
+         return;                // Resent when reconnected
+   }
+}
+
+static void
+lwmqtt_qos_ack (lwmqtt_t handle, unsigned short id)
+{                               // PUBACK received
+   lwmqtt_q_t *q = NULL,
+      *prev = NULL;
+   xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+   for (q = handle->qoshead; q && (!q->sent || q->id != id); q = q->next)
+      prev = q;
+   if (q)
+   {
+      if (prev)
+         prev->next = q->next;
+      else
+         handle->qoshead = q->next;
+      if (handle->qostail == q)
+         handle->qostail = prev;
+      handle->inflight--;
+      handle->qosbytes -= q->len;
+   }
+   xSemaphoreGive (handle->qmutex);
+   if (!q)
+   {
+      ESP_LOGD (TAG, "Unexpected PUBACK %04X", id);
+      return;
+   }
+   if (handle->sent)
+      handle->sent (handle->arg, q->ref, NULL);
+   free (q);
+}
+
+static void
+lwmqtt_qos_resend (lwmqtt_t handle)
+{                               // Disconnected, so in flight QoS 1 messages are sent again, with DUP, when reconnected
+   if (!handle->qmutex)
+      return;
+   xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+   for (lwmqtt_q_t * q = handle->qoshead; q; q = q->next)
+      if (q->sent)
+      {
+         q->sent = 0;
+         q->frame[0] |= 0x08;   // DUP
+         handle->qosunsent++;
+      }
+   handle->inflight = 0;
+   xSemaphoreGive (handle->qmutex);
+}
+
+static void
+lwmqtt_qos_fail (lwmqtt_t handle, const char *err)
+{                               // Drop all QoS 1 messages
+   if (!handle->qmutex)
+      return;
+   xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+   lwmqtt_q_t *q = handle->qoshead;
+   handle->qoshead = handle->qostail = NULL;
+   handle->qosbytes = 0;
+   handle->qosunsent = 0;
+   handle->inflight = 0;
+   xSemaphoreGive (handle->qmutex);
+   while (q)
+   {
+      lwmqtt_q_t *next = q->next;
+      if (handle->sent)
+         handle->sent (handle->arg, q->ref, err);
+      free (q);
+      q = next;
+   }
+}
+
+static int
+lwmqtt_wake_socket (void)
+{                               // A UDP socket connected to itself, to wake a task select
+   int s = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if (s < 0)
+      return s;
+   struct sockaddr_in a = {.sin_family = AF_INET,.sin_addr.s_addr = htonl (INADDR_LOOPBACK) };
+   socklen_t l = sizeof (a);
+   if (bind (s, (void *) &a, l) || getsockname (s, (void *) &a, &l) || connect (s, (void *) &a, l))
+   {
+      ESP_LOGE (TAG, "Wake socket failed");
+      close (s);
+      return -1;
+   }
+   fcntl (s, F_SETFL, O_NONBLOCK);
+   return s;
+}
+
+#ifdef	CONFIG_REVK_MQTT_ONETASK
+static lwmqtt_t io_list = NULL; // Client handles for I/O task
+static SemaphoreHandle_t io_mutex = NULL;
+static int io_wake = -1;        // UDP socket to wake I/O task
+static uint8_t io_state = 0;    // 0=not started, 1=starting, 2=running
+#endif
+
+static void
+lwmqtt_queue_init (lwmqtt_t handle, lwmqtt_client_config_t * config)
+{                               // Set up queue, and a UDP socket connected to itself to wake the client task select when something is queued
+   handle->wake = -1;
+   if (!config->queue && !config->window)
+      return;
+   if (!(handle->qmutex = xSemaphoreCreateBinary ()))
+      return;
+   xSemaphoreGive (handle->qmutex);
+   handle->queue = config->queue;
+   handle->window = config->window;
+   handle->qosmem = config->qosmem ? : LWMQTT_QOSMEM;
+   handle->queue_old = config->queue_old;
+   handle->sent = config->sent;
+   if (config->ca_cert_bytes || config->crt_bundle_attach)
+      handle->wbuf = mallocspi (LWMQTT_WBUF);   // Used for QoS 1 and queued
+#ifndef	CONFIG_REVK_MQTT_ONETASK
+   handle->wake = lwmqtt_wake_socket ();
+#endif
+}
+
+static void
+lwmqtt_wake (lwmqtt_t handle)
+{                               // Wake the task handling this handle
+#ifdef	CONFIG_REVK_MQTT_ONETASK
+   if (io_wake >= 0)
+      send (io_wake, "", 1, 0);
+#else
+   if (handle->wake >= 0)
+      send (handle->wake, "", 1, 0);
+#endif
+}
+
 static void *
 handle_free (lwmqtt_t handle)
 {
@@ -111,6 +484,13 @@ handle_free (lwmqtt_t handle)
          freez (handle->our_key_buf);
       if (handle->mutex)
          vSemaphoreDelete (handle->mutex);
+      lwmqtt_queue_fail (handle, "Closed");
+      lwmqtt_qos_fail (handle, "Closed");
+      if (handle->qmutex)
+         vSemaphoreDelete (handle->qmutex);
+      if (handle->wake >= 0)
+         close (handle->wake);  // Only set for client with queue
+      freez (handle->wbuf);
       freez (handle);
    }
    return NULL;
@@ -135,7 +515,9 @@ handle_close (lwmqtt_t handle)
          esp_tls_conn_destroy (tls);
    } else if (sock >= 0)
       close (sock);
-   usleep (100000);
+#ifndef	CONFIG_REVK_MQTT_ONETASK
+   usleep (100000);             // Not in I/O task as would hold up other clients, io_closed sets retry time
+#endif
 }
 
 static int
@@ -176,7 +558,11 @@ handle_certs (lwmqtt_t h, uint8_t ca_cert_ref, int ca_cert_bytes, void *ca_cert_
    return fail;
 }
 
+#ifdef	CONFIG_REVK_MQTT_ONETASK
+static int io_add (lwmqtt_t handle);
+#else
 static void client_task (void *pvParameters);
+#endif
 #ifdef  CONFIG_REVK_MQTT_SERVER
 static void listen_task (void *pvParameters);
 #endif
@@ -192,9 +578,11 @@ lwmqtt_client (lwmqtt_client_config_t * config)
       return handle_free (handle);
    memset (handle, 0, sizeof (*handle));
    handle->sock = -1;
+   lwmqtt_queue_init (handle, config);
    handle->callback = config->callback;
    handle->arg = config->arg;
    handle->keepalive = config->keepalive ? : 60;
+   handle->rxmax = config->rxmax ? : LWMQTT_RXMAX;
    if ((handle->hostname_ref = config->hostname_ref))
       handle->hostname = (void *) config->hostname;
    else if (!(handle->hostname = strdup (config->hostname)))
@@ -221,12 +609,11 @@ lwmqtt_client (lwmqtt_client_config_t * config)
         config->client_cert_buf, config->client_key_ref, config->client_key_bytes, config->client_key_buf))
       return handle_free (handle);      // Nope
    handle->crt_bundle_attach = config->crt_bundle_attach;
-   if (mlen >= 128 * 128)
-      return handle_free (handle);      // Nope
    mlen += 2;                   // keepalive
-   if (mlen >= 128)
-      mlen++;                   // two byte len
-   mlen += 2;                   // header and one byte len
+   if (mlen >= 0xFFF0)
+      return handle_free (handle);      // Nope (connectlen)
+   int rlen = mlen;
+   mlen += 1 + lwmqtt_varlen (rlen);    // header and len
    if (!(handle->connect = mallocspi (mlen)))
       return handle_free (handle);
    unsigned char *p = handle->connect;
@@ -241,12 +628,7 @@ lwmqtt_client (lwmqtt_client_config_t * config)
       p += l;
    }
    *p++ = 0x10;                 // connect
-   if (mlen > 129)
-   {                            // Two byte len
-      *p++ = (((mlen - 3) & 0x7F) | 0x80);
-      *p++ = ((mlen - 3) >> 7);
-   } else
-      *p++ = mlen - 2;          // 1 byte len
+   p = lwmqtt_varint (p, rlen);
    str (4, "MQTT");
    *p++ = 4;                    // protocol level
    *p = 0x02;                   // connect flags (clean)
@@ -282,8 +664,13 @@ lwmqtt_client (lwmqtt_client_config_t * config)
    handle->mutex = xSemaphoreCreateBinary ();
    xSemaphoreGive (handle->mutex);
    handle->running = 1;
+#ifdef	CONFIG_REVK_MQTT_ONETASK
+   if (io_add (handle))
+      return handle_free (handle);
+#else
    TaskHandle_t task_id = NULL;
    xTaskCreate (client_task, "mqtt-client", 4 * 1024, (void *) handle, 2, &task_id);
+#endif
    return handle;
 }
 
@@ -298,7 +685,9 @@ lwmqtt_server (lwmqtt_server_config_t * config)
    if (!handle)
       return handle_free (handle);
    memset (handle, 0, sizeof (*handle));
+   handle->wake = -1;
    handle->callback = config->callback;
+   handle->rxmax = config->rxmax ? : LWMQTT_RXMAX;
    handle->port = (config->port ? : config->ca_cert_bytes ? 8883 : 1883);
    if (handle_certs
        (handle, config->ca_cert_ref, config->ca_cert_bytes, config->ca_cert_buf, config->server_cert_ref, config->server_cert_bytes,
@@ -322,6 +711,9 @@ lwmqtt_end (lwmqtt_t * handle)
    {
       ESP_LOGD (TAG, "Ending");
       (*handle)->running = 0;
+#ifdef	CONFIG_REVK_MQTT_ONETASK
+      lwmqtt_wake (*handle);    // Only safe for I/O task, as client task may free handle
+#endif
    }
    *handle = NULL;
 }
@@ -335,6 +727,7 @@ lwmqtt_reconnect (lwmqtt_t handle)
    {
       ESP_LOGD (TAG, "Closing to reconnect");
       handle->close = 1;
+      lwmqtt_wake (handle);
    }
 }
 
@@ -344,7 +737,10 @@ lwmqtt_reconnect6 (lwmqtt_t handle)
    if (!handle)
       return;
    if (handle->running && (handle->dnsipv6 || handle->tls) && !handle->ipv6)
-      handle->close = 1;        // Reconnect as IPv6 (we don't know for TLS so reconnect anyway)
+   {                            // Reconnect as IPv6 (we don't know for TLS so reconnect anyway)
+      handle->close = 1;
+      lwmqtt_wake (handle);
+   }
 }
 
 // Subscribe (return is non null error message if failed)
@@ -359,56 +755,40 @@ lwmqtt_subscribeub (lwmqtt_t handle, const char *topic, char unsubscribe)
    else
    {
       int tlen = strlen (topic ? : "");
-      int mlen = 2 + 2 + tlen;
+      int rlen = 2 + 2 + tlen;
       if (!unsubscribe)
-         mlen++;                // QoS requested
-      if (mlen >= 128 * 128)
+         rlen++;                // QoS requested
+      if (rlen > 0xFFFF)
          ret = "Too big";
+      else if (!xSemaphoreTake (handle->mutex, portMAX_DELAY))
+         ret = "Failed to get lock";
       else
       {
-         if (mlen >= 128)
-            mlen++;             // two byte len
-         mlen += 2;             // header and one byte len
-         unsigned char *buf = mallocspi (mlen);
-         if (!buf)
-            ret = "Malloc";
+         if (handle->sock < 0)
+            ret = "Not connected";
          else
          {
-            if (!xSemaphoreTake (handle->mutex, portMAX_DELAY))
-               ret = "Failed to get lock";
-            else
-            {
-               if (handle->sock < 0)
-                  ret = "Not connected";
-               else
-               {
-                  unsigned char *p = buf;
-                  *p++ = (unsubscribe ? 0xA2 : 0x82);   // subscribe/unsubscribe
-                  if (mlen > 129)
-                  {             // Two byte len
-                     *p++ = (((mlen - 3) & 0x7F) | 0x80);
-                     *p++ = ((mlen - 3) >> 7);
-                  } else
-                     *p++ = mlen - 2;   // 1 byte len
-                  if (!++(handle->seq))
-                     handle->seq++;     // Non zero
-                  *p++ = handle->seq >> 8;
-                  *p++ = handle->seq;
-                  *p++ = tlen >> 8;
-                  *p++ = tlen;
-                  if (tlen)
-                     memcpy (p, topic, tlen);
-                  p += tlen;
-                  if (!unsubscribe)
-                     *p++ = 0x00;       // QoS requested
-                  assert ((p - buf) == mlen);
-                  if (hwrite (handle, buf, mlen) < mlen)
-                     ret = "Failed to send";
-               }
-               xSemaphoreGive (handle->mutex);
-            }
-            freez (buf);
+            unsigned char head[9],
+             *p = head;
+            *p++ = (unsubscribe ? 0xA2 : 0x82); // subscribe/unsubscribe
+            p = lwmqtt_varint (p, rlen);
+            if (!++(handle->seq))
+               handle->seq++;   // Non zero
+            *p++ = handle->seq >> 8;
+            *p++ = handle->seq;
+            *p++ = tlen >> 8;
+            *p++ = tlen;
+            static const unsigned char qos = 0x00;      // QoS requested
+            struct iovec iov[] = {
+               {head, p - head},
+               {(void *) topic, tlen},
+               {(void *) &qos, unsubscribe ? 0 : 1},
+            };
+            int mlen = p - head - 4 + rlen;     // Fixed header and remaining length
+            if (hwritev (handle, iov, sizeof (iov) / sizeof (*iov)) < mlen)
+               ret = "Failed to send";
          }
+         xSemaphoreGive (handle->mutex);
       }
    }
    if (ret)
@@ -416,9 +796,110 @@ lwmqtt_subscribeub (lwmqtt_t handle, const char *topic, char unsubscribe)
    return ret;
 }
 
+static int
+lwmqtt_pub_len (int tlen, int plen)
+{                               // Length of publish header (fixed header, length, topic) before payload, 0 if too big
+   if (tlen > 0xFFFF || plen > LWMQTT_MAX - 2 - tlen)
+      return 0;
+   return 1 + lwmqtt_varlen (2 + tlen + plen) + 2 + tlen;
+}
+
+static void
+lwmqtt_pub_header (unsigned char *p, int tlen, int plen, char retain)
+{                               // Write publish header, lwmqtt_pub_len bytes less the topic itself
+   *p++ = 0x30 + (retain ? 1 : 0);      // message
+   p = lwmqtt_varint (p, 2 + tlen + plen);
+   *p++ = tlen >> 8;
+   *p++ = tlen;
+}
+
+static const char *
+lwmqtt_send_frame (lwmqtt_t handle, const unsigned char *buf, int len)
+{                               // Send a whole frame
+   const char *ret = NULL;
+   if (!xSemaphoreTake (handle->mutex, portMAX_DELAY))
+      ret = "Failed to get lock";
+   else
+   {
+      if (handle->sock < 0)
+         ret = "Not connected";
+      else if (hwrite (handle, (void *) buf, len) < len)
+         ret = "Failed to send";
+      xSemaphoreGive (handle->mutex);
+   }
+   return ret;
+}
+
+static const char *
+lwmqtt_queue (lwmqtt_t handle, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, void *ref)
+{                               // Make message and queue it for client task
+   int hlen = lwmqtt_pub_len (tlen, plen);
+   if (!hlen)
+      return "Too big";
+   if (handle->sock < 0)
+      return "Not connected";
+   lwmqtt_q_t *q = mallocspi (sizeof (*q) + hlen + plen);
+   if (!q)
+      return "Malloc";
+   q->next = NULL;
+   q->ref = ref;
+   q->len = hlen + plen;
+   lwmqtt_pub_header (q->frame, tlen, plen, retain);
+   if (tlen)
+      memcpy (q->frame + hlen - tlen, topic, tlen);
+   if (plen)
+      memcpy (q->frame + hlen, payload, plen);
+   lwmqtt_q_t *drop = NULL;
+   xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+   if (handle->queued >= handle->queue)
+   {                            // Full
+      if (handle->queue_old)
+      {                         // Drop oldest
+         drop = handle->qhead;
+         if (!(handle->qhead = drop->next))
+            handle->qtail = NULL;
+         handle->queued--;
+      } else
+      {                         // Drop this one
+         drop = q;
+         q = NULL;
+      }
+   }
+   if (q)
+   {
+      if (handle->qtail)
+         handle->qtail->next = q;
+      else
+         handle->qhead = q;
+      handle->qtail = q;
+      handle->queued++;
+   }
+   xSemaphoreGive (handle->qmutex);
+   if (!q)
+   {
+      free (drop);
+      return "Queue full";
+   }
+   if (drop)
+   {
+      if (handle->sent)
+         handle->sent (handle->arg, drop->ref, "Queue full");
+      free (drop);
+   }
+   lwmqtt_wake (handle);        // Wake client task
+   return NULL;
+}
+
 // Send (return is non null error message if failed)
 const char *
 lwmqtt_send_full (lwmqtt_t handle, int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{
+   return lwmqtt_send_ref (handle, tlen, topic, plen, payload, retain, NULL);
+}
+
+// Send, if queued then ref is passed to sent callback (return is non null error message if failed)
+const char *
+lwmqtt_send_ref (lwmqtt_t handle, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, void *ref)
 {
    const char *ret = NULL;
    if (!handle)
@@ -427,53 +908,32 @@ lwmqtt_send_full (lwmqtt_t handle, int tlen, const char *topic, int plen, const
    {
       if (tlen < 0)
          tlen = strlen (topic ? : "");
-      if (plen < 0)
+      if (plen < 0 || !payload)
          plen = strlen ((char *) payload ? : "");
-      int mlen = 2 + tlen + plen;
-      if (mlen >= 128 * 128)
+      int hlen = lwmqtt_pub_len (tlen, plen);
+      if (handle->queue)
+         ret = lwmqtt_queue (handle, tlen, topic, plen, payload, retain, ref);
+      else if (!hlen)
          ret = "Too big";
+      else if (!xSemaphoreTake (handle->mutex, portMAX_DELAY))
+         ret = "Failed to get lock";
       else
-      {
-         if (mlen >= 128)
-            mlen++;             // two byte len
-         mlen += 2;             // header and one byte len
-         unsigned char *buf = mallocspi (mlen);
-         if (!buf)
-            ret = "Malloc";
+      {                         // Header, topic, and payload sent from where they are
+         if (handle->sock < 0)
+            ret = "Not connected";
          else
          {
-            if (!xSemaphoreTake (handle->mutex, portMAX_DELAY))
-               ret = "Failed to get lock";
-            else
-            {
-               if (handle->sock < 0)
-                  ret = "Not connected";
-               else
-               {
-                  unsigned char *p = buf;
-                  *p++ = 0x30 + (retain ? 1 : 0);       // message
-                  if (mlen > 129)
-                  {             // Two byte len
-                     *p++ = (((mlen - 3) & 0x7F) | 0x80);
-                     *p++ = ((mlen - 3) >> 7);
-                  } else
-                     *p++ = mlen - 2;   // 1 byte len
-                  *p++ = tlen >> 8;
-                  *p++ = tlen;
-                  if (tlen)
-                     memcpy (p, topic, tlen);
-                  p += tlen;
-                  if (plen && payload)
-                     memcpy (p, payload, plen);
-                  p += plen;
-                  assert ((p - buf) == mlen);
-                  if (hwrite (handle, buf, mlen) < mlen)
-                     ret = "Failed to send";
-               }
-               xSemaphoreGive (handle->mutex);
-            }
-            freez (buf);
+            unsigned char head[7];
+            lwmqtt_pub_header (head, tlen, plen, retain);
+            struct iovec iov[] = {
+               {head, hlen - tlen},
+               {(void *) topic, tlen},
+               {(void *) payload, plen},
+            };
+            if (hwritev (handle, iov, sizeof (iov) / sizeof (*iov)) < hlen + plen)
+               ret = "Failed to send";
          }
+         xSemaphoreGive (handle->mutex);
       }
    }
    if (ret)
@@ -481,390 +941,826 @@ lwmqtt_send_full (lwmqtt_t handle, int tlen, const char *topic, int plen, const
    return ret;
 }
 
-static void
-lwmqtt_loop (lwmqtt_t handle)
+// Send, with the header written in place in the head room before payload, so no copy (return is non null error message if failed)
+const char *
+lwmqtt_send_head (lwmqtt_t handle, int head, int tlen, const char *topic, int plen, unsigned char *payload, char retain)
 {
-   // Handle rx messages
-   unsigned char *buf = 0;
-   int buflen = 0;
-   int pos = 0;
-   uint32_t kacheck = uptime () + 60;   // Response time check
-   uint32_t ka = uptime () + (handle->server ? 5 : handle->keepalive);  // Server does not know KA initially
-   while (handle->running && !handle->close)
-   {                            // Loop handling messages received, and timeouts
-      int need = 0;
-      if (pos < 2)
-         need = 2;
-      else if (!(buf[1] & 0x80))
-         need = 2 + buf[1];     // One byte len
-      else if (pos < 3)
-         need = 3;
-      else if (!(buf[2] & 0x80))
-         need = 3 + (buf[2] << 7) + (buf[1] & 0x7F);    // Two byte len
+   if (tlen < 0)
+      tlen = strlen (topic ? : "");
+   if (plen < 0)
+      plen = strlen ((char *) payload ? : "");
+   int hlen = lwmqtt_pub_len (tlen, plen);
+   if (!handle || !hlen || head < hlen || handle->queue)
+      return lwmqtt_send_full (handle, tlen, topic, plen, payload, retain);     // Not enough head room, or queued, so copy
+   lwmqtt_pub_header (payload - hlen, tlen, plen, retain);
+   if (tlen)
+      memcpy (payload - tlen, topic, tlen);
+   const char *ret = lwmqtt_send_frame (handle, payload - hlen, hlen + plen);
+   if (ret)
+      ESP_LOGD (TAG, "Send: %s", ret);
+   return ret;
+}
+
+// Send QoS 1, kept (even if not connected) and resent until acked, sent callback when acked (return is non null error message if failed)
+const char *
+lwmqtt_send_qos1 (lwmqtt_t handle, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, void *ref)
+{
+   const char *ret = NULL;
+   if (!handle)
+      ret = "No handle";
+   else if (!handle->window)
+      ret = "No QoS 1";
+   else
+   {
+      if (tlen < 0)
+         tlen = strlen (topic ? : "");
+      if (plen < 0 || !payload)
+         plen = strlen ((char *) payload ? : "");
+      int hlen = lwmqtt_pub_len (tlen, 2 + plen);       // Packet ID after topic
+      lwmqtt_q_t *q = NULL;
+      if (!hlen)
+         ret = "Too big";
+      else if (!(q = mallocspi (sizeof (*q) + hlen + 2 + plen)))
+         ret = "Malloc";
       else
       {
-         ESP_LOGE (TAG, "Silly len %02X %02X %02X", buf[0], buf[1], buf[2]);
-         break;
+         memset (q, 0, sizeof (*q));
+         q->ref = ref;
+         q->len = hlen + 2 + plen;
+         q->idpos = hlen;
+         lwmqtt_pub_header (q->frame, tlen, 2 + plen, retain);
+         q->frame[0] |= 0x02;   // QoS 1
+         if (tlen)
+            memcpy (q->frame + hlen - tlen, topic, tlen);
+         if (plen)
+            memcpy (q->frame + hlen + 2, payload, plen);
+         xSemaphoreTake (handle->qmutex, portMAX_DELAY);
+         if (handle->qosbytes + q->len > handle->qosmem)
+            ret = "Queue full";
+         else
+         {
+            if (handle->qostail)
+               handle->qostail->next = q;
+            else
+               handle->qoshead = q;
+            handle->qostail = q;
+            handle->qosbytes += q->len;
+            handle->qosunsent++;
+         }
+         xSemaphoreGive (handle->qmutex);
+         if (ret)
+            free (q);
+         else
+            lwmqtt_wake (handle);       // Wake client task
       }
-      if (pos < need)
+   }
+   if (ret)
+      ESP_LOGD (TAG, "Send: %s", ret);
+   return ret;
+}
+
+// Streaming publish start, sends header and topic, holding send lock until lwmqtt_send_end (return is non null error message if failed)
+const char *
+lwmqtt_send_start (lwmqtt_t handle, int tlen, const char *topic, int plen, char retain)
+{
+   const char *ret = NULL;
+   if (!handle)
+      ret = "No handle";
+   else
+   {
+      if (tlen < 0)
+         tlen = strlen (topic ? : "");
+      int hlen = (plen < 0 ? 0 : lwmqtt_pub_len (tlen, plen));
+      if (!hlen)
+         ret = "Too big";
+      else if (!xSemaphoreTake (handle->mutex, portMAX_DELAY))
+         ret = "Failed to get lock";
+      else
       {
-         uint32_t now = uptime ();
-         if (now >= ka)
-         {
-            if (handle->server)
-               break;           // timeout
-            // client, so send ping - do so regularly regardless as we want pingresp regularly to detect down as a client.
-            uint8_t b[] = { 0xC0, 0x00 };       // Ping
-            xSemaphoreTake (handle->mutex, portMAX_DELAY);
-            hwrite (handle, b, sizeof (b));
+         unsigned char head[7];
+         lwmqtt_pub_header (head, tlen, plen, retain);
+         struct iovec iov[] = {
+            {head, hlen - tlen},
+            {(void *) topic, tlen},
+         };
+         if (handle->sock < 0)
+            ret = "Not connected";
+         else if (hwritev (handle, iov, sizeof (iov) / sizeof (*iov)) < hlen)
+            ret = "Failed to send";
+         if (ret)
             xSemaphoreGive (handle->mutex);
-            ka = uptime () + handle->keepalive; // Client KA next
-            kacheck = uptime () + 10;   // Expect KA resp
-         } else if (kacheck && kacheck < uptime ())
-         {                      // only set for client anyway
-            ESP_LOGE (TAG, "KA fail");
-            break;
-         }
-         if (!handle->tls || esp_tls_get_bytes_avail (handle->tls) <= 0)
-         {                      // Wait for data to arrive
-            fd_set r,
-              e;
-            FD_ZERO (&r);
-            FD_SET (handle->sock, &r);
-            FD_ZERO (&e);
-            FD_SET (handle->sock, &e);
-            struct timeval to = { 1, 0 };       // Keeps us checking running but is light load at once a second
-            int sel = select (handle->sock + 1, &r, NULL, &e, &to);
-            if (sel < 0)
-            {
-               ESP_LOGE (TAG, "Select failed");
-               break;
-            }
-            if (FD_ISSET (handle->sock, &e))
-            {
-               ESP_LOGE (TAG, "Closed");
-               break;
-            }
-            if (!FD_ISSET (handle->sock, &r))
-               continue;        // Nothing waiting
-         }
-         if (need > buflen)
-         {                      // Make sure we have enough space
-            buf = realloc (buf, (buflen = need) + 1);   // One more to allow extra null on end in all cases
-            if (!buf)
-            {
-               ESP_LOGE (TAG, "realloc fail %d", need);
-               break;
-            }
-         }
-         int got = hread (handle, buf + pos, need - pos);
-         if (got <= 0)
+         else
          {
-            ESP_LOGI (TAG, "Connection closed");
-            break;              // Error or close
+            handle->streamlen = plen;
+            handle->streaming = 1;
          }
-         pos += got;
-         continue;
       }
-      kacheck = 0;              // We got something (does not have to be pingresp)
-      if (handle->server)
-         ka = uptime () + handle->keepalive * 3 / 2;    // timeout for client resent on message received
-      unsigned char *p = buf + 1,
-         *e = buf + pos;
-      while (p < e && (*p & 0x80))
-         p++;
+   }
+   if (ret)
+      ESP_LOGD (TAG, "Send: %s", ret);
+   return ret;
+}
+
+// Streaming publish, send more of the payload (return is non null error message if failed)
+const char *
+lwmqtt_send_more (lwmqtt_t handle, int len, const unsigned char *data)
+{
+   if (!handle || !handle->streaming)
+      return "Not sending";
+   if (len < 0)
+      len = strlen ((char *) data ? : "");
+   if (len > handle->streamlen)
+      return "Too much";
+   if (handle->sock < 0)
+      return "Not connected";
+   if (len && hwrite (handle, (void *) data, len) < len)
+      return "Failed to send";
+   handle->streamlen -= len;
+   return NULL;
+}
+
+// Streaming publish end, releases send lock, error if not all of the payload was sent (return is non null error message if failed)
+const char *
+lwmqtt_send_end (lwmqtt_t handle)
+{
+   if (!handle || !handle->streaming)
+      return "Not sending";
+   const char *ret = NULL;
+   if (handle->streamlen)
+   {                            // Message is incomplete, so cannot carry on with connection
+      ret = "Payload short";
+      handle->close = 1;
+   }
+   handle->streamlen = 0;
+   handle->streaming = 0;
+   xSemaphoreGive (handle->mutex);
+   if (ret)
+      ESP_LOGD (TAG, "Send: %s", ret);
+   return ret;
+}
+
+static void
+lwmqtt_loop_start (lwmqtt_t handle)
+{                               // Start handling a new connection
+   handle->rxstart = handle->rxend = handle->rxskip = 0;
+   handle->kacheck = uptime () + 60;    // Response time check
+   handle->ka = uptime () + (handle->server ? 5 : handle->keepalive);   // Server does not know KA initially
+}
+
+static int
+lwmqtt_message (lwmqtt_t handle)
+{                               // Handle next whole message in rx, returns 1 if done, 0 if more needed (rxneed), -1 if bad
+   unsigned char *buf = handle->rx + handle->rxstart;   // Current message
+   int pos = handle->rxend - handle->rxstart;   // How much of it we have
+   int need = 0,
+      len = 0;
+   for (int n = 1; !need; n++)
+      if (pos <= n)
+         need = n + 1;          // Need more of len
+      else
+      {
+         len |= (buf[n] & 0x7F) << (7 * (n - 1));
+         if (!(buf[n] & 0x80))
+            need = 1 + n + len; // Whole message
+         else if (n == 4)
+            need = -1;          // Too long
+      }
+   if (need < 0)
+   {
+      ESP_LOGE (TAG, "Silly len %02X %02X %02X %02X %02X", buf[0], buf[1], buf[2], buf[3], buf[4]);
+      return -1;
+   }
+   if (need > handle->rxmax)
+   {                            // Too big, drop rather than allocate
+      ESP_LOGE (TAG, "Dropped %02X len %d (max %lu)", *buf, need, (unsigned long) handle->rxmax);
+      if (pos < need)
+      {                         // Discard rest as it arrives
+         handle->rxskip = need - pos;
+         need = pos;
+      }
+      handle->rxstart += need;
+      if (handle->rxstart == handle->rxend)
+         handle->rxstart = handle->rxend = 0;   // All used
+      return 1;
+   }
+   if (pos < need)
+   {
+      handle->rxneed = need;
+      return 0;
+   }
+   handle->kacheck = 0;         // We got something (does not have to be pingresp)
+   if (handle->server)
+      handle->ka = uptime () + handle->keepalive * 3 / 2;       // timeout for client resent on message received
+   unsigned char *p = buf + 1,
+      *e = buf + need;
+   unsigned char next = *e;     // Could be start of next message, but null is added after payload
+   while (p < e && (*p & 0x80))
       p++;
+   p++;
 #ifdef CONFIG_REVK_MQTT_SERVER
-      if (handle->server && !handle->connected && (*buf >> 4) != 1)
-         break;                 // Expect login as first message
+   if (handle->server && !handle->connected && (*buf >> 4) != 1)
+      return -1;                // Expect login as first message
 #endif
-      switch (*buf >> 4)
-      {
-      case 1:
+   switch (*buf >> 4)
+   {
+   case 1:
 #ifdef CONFIG_REVK_MQTT_SERVER
-         if (!handle->server)
-            break;
-         handle->connected = 1;
-         ESP_LOGI (TAG, "Connected incoming %d", handle->port);
-         // TODO incoming connect
-         handle->keepalive = 10;        // TODO get from message
-         uint8_t b[4] = { 0x20 };       // conn ack
-         xSemaphoreTake (handle->mutex, portMAX_DELAY);
-         hwrite (handle, b, sizeof (b));
-         xSemaphoreGive (handle->mutex);
+      if (!handle->server)
+         break;
+      handle->connected = 1;
+      ESP_LOGI (TAG, "Connected incoming %d", handle->port);
+      // TODO incoming connect
+      handle->keepalive = 10;   // TODO get from message
+      uint8_t b[4] = { 0x20 };  // conn ack
+      xSemaphoreTake (handle->mutex, portMAX_DELAY);
+      hwrite (handle, b, sizeof (b));
+      xSemaphoreGive (handle->mutex);
 #endif
+      break;
+   case 2:                  // conack
+      if (handle->server)
          break;
-      case 2:                  // conack
-         if (handle->server)
-            break;
-         if (p[1])
-         {                      // Failed
-            ESP_LOGI (TAG, "Connect failed %s:%d code %d", handle->hostname, handle->port, p[1]);
-            handle->failed = (p[1] > 7 ? 7 : p[1]);
-         } else
+      if (p[1])
+      {                         // Failed
+         ESP_LOGI (TAG, "Connect failed %s:%d code %d", handle->hostname, handle->port, p[1]);
+         handle->failed = (p[1] > 7 ? 7 : p[1]);
+      } else
+      {
+         ESP_LOGI (TAG, "Connect ack  %s:%d", handle->hostname, handle->port);
+         handle->failed = 0;
+         handle->backoff = 0;
+         handle->connected = 1;
+         handle->connecttime = uptime ();
+         if (handle->callback)
+            handle->callback (handle->arg, NULL, strlen (handle->hostname), (void *) handle->hostname);
+      }
+      break;
+   case 3:                  // pub
+      {                         // Topic
+         int tlen = (p[0] << 8) + p[1];
+         p += 2;
+         char *topic = (char *) p;
+         p += tlen;
+         unsigned short id = 0;
+         if (*buf & 0x06)
          {
-            ESP_LOGI (TAG, "Connect ack  %s:%d", handle->hostname, handle->port);
-            handle->failed = 0;
-            handle->backoff = 0;
-            handle->connected = 1;
-            handle->connecttime = uptime ();
-            if (handle->callback)
-               handle->callback (handle->arg, NULL, strlen (handle->hostname), (void *) handle->hostname);
-         }
-         break;
-      case 3:                  // pub
-         {                      // Topic
-            int tlen = (p[0] << 8) + p[1];
+            id = (p[0] << 8) + p[1];
             p += 2;
-            char *topic = (char *) p;
-            p += tlen;
-            unsigned short id = 0;
-            if (*buf & 0x06)
-            {
-               id = (p[0] << 8) + p[1];
-               p += 2;
-            }
-            if (p > e)
-            {
-               ESP_LOGE (TAG, "Bad msg");
-               break;
-            }
-            if (*buf & 0x06)
-            {                   // reply
-               uint8_t b[4] = { (*buf & 0x4) ? 0x50 : 0x40, 2, id >> 8, id };
-               xSemaphoreTake (handle->mutex, portMAX_DELAY);
-               hwrite (handle, b, sizeof (b));
-               xSemaphoreGive (handle->mutex);
-            }
-            int plen = e - p;
-            if (handle->callback)
-            {
-               if (plen && !(*buf & 0x06))
-               {                // Move back a byte for null termination to be added without hitting payload
-                  memmove (topic - 1, topic, tlen);
-                  topic--;
-               }
-               topic[tlen] = 0;
-               p[plen] = 0;
-               handle->callback (handle->arg, topic, plen, p);
-            }
          }
-         break;
-      case 4:                  // puback - no action as we don't use non QoS 0
-         break;
-      case 5:                  // pubrec - not expected as we don't use non QoS 0
-         if (handle->server)
-            break;
+         if (p > e)
          {
-            uint8_t b[4] = { 0x60, p[0], p[1] };
+            ESP_LOGE (TAG, "Bad msg");
+            break;
+         }
+         if (*buf & 0x06)
+         {                      // reply
+            uint8_t b[4] = { (*buf & 0x4) ? 0x50 : 0x40, 2, id >> 8, id };
             xSemaphoreTake (handle->mutex, portMAX_DELAY);
             hwrite (handle, b, sizeof (b));
             xSemaphoreGive (handle->mutex);
          }
+         int plen = e - p;
+         if (handle->callback)
+         {
+            if (plen && !(*buf & 0x06))
+            {                   // Move back a byte for null termination to be added without hitting payload
+               memmove (topic - 1, topic, tlen);
+               topic--;
+            }
+            topic[tlen] = 0;
+            p[plen] = 0;
+            handle->callback (handle->arg, topic, plen, p);
+         }
+      }
+      break;
+   case 4:                  // puback
+      if (handle->server)
          break;
-      case 6:                  // pubcomp - no action as we don't use non QoS 0
+      lwmqtt_qos_ack (handle, (p[0] << 8) + p[1]);
+      break;
+   case 5:                  // pubrec - not expected as we don't use non QoS 0
+      if (handle->server)
          break;
-      case 8:                  // sub
+      {
+         uint8_t b[4] = { 0x60, p[0], p[1] };
+         xSemaphoreTake (handle->mutex, portMAX_DELAY);
+         hwrite (handle, b, sizeof (b));
+         xSemaphoreGive (handle->mutex);
+      }
+      break;
+   case 6:                  // pubcomp - no action as we don't use non QoS 0
+      break;
+   case 8:                  // sub
 #ifdef CONFIG_REVK_MQTT_SERVER
-         if (!handle->server)
-            break;
-         // TODO
-#endif
+      if (!handle->server)
          break;
-      case 9:                  // suback - no action
-         break;
-      case 10:                 // unsub - no action
-         break;
-      case 11:                 // unsuback - ok
-         if (handle->server)
-            break;
-         break;
-      case 12:                 // ping (no action as resets ka anyway)
-         break;
-      case 13:                 // pingresp
+      // TODO
+#endif
+      break;
+   case 9:                  // suback - no action
+      break;
+   case 10:                 // unsub - no action
+      break;
+   case 11:                 // unsuback - ok
+      if (handle->server)
          break;
+      break;
+   case 12:                 // ping (no action as resets ka anyway)
+      break;
+   case 13:                 // pingresp
+      break;
 #ifdef CONFIG_REVK_MQTT_SERVER
-      case 14:                 // disconnect
-         ESP_LOGE (TAG, "Client disconnected");
-         break;
+   case 14:                 // disconnect
+      ESP_LOGE (TAG, "Client disconnected");
+      break;
 #endif
-      default:
-         ESP_LOGE (TAG, "Unknown MQTT %02X (%d)", *buf, pos);
+   default:
+      ESP_LOGE (TAG, "Unknown MQTT %02X (%d)", *buf, need);
+   }
+   *e = next;
+   handle->rxstart += need;
+   if (handle->rxstart == handle->rxend)
+      handle->rxstart = handle->rxend = 0;      // All used
+   return 1;
+}
+
+static int
+lwmqtt_read (lwmqtt_t handle)
+{                               // Read as much as available in to rx, returns -1 if closed or failed
+   if (handle->rxskip)
+   {                            // Discarding a message over rxmax, rx is empty and at least LWMQTT_RX
+      int got = hread (handle, handle->rx, handle->rxskip < handle->rxlen ? handle->rxskip : handle->rxlen);
+      if (got <= 0)
+      {
+         ESP_LOGI (TAG, "Connection closed");
+         return -1;             // Error or close
+      }
+      handle->rxskip -= got;
+      return got;
+   }
+   int need = handle->rxneed,
+      pos = handle->rxend - handle->rxstart;
+   if (handle->rxstart && (handle->rxstart + need > handle->rxlen || handle->rxend == handle->rxlen))
+   {                            // Move partial message to start
+      memmove (handle->rx, handle->rx + handle->rxstart, pos);
+      handle->rxstart = 0;
+      handle->rxend = pos;
+   }
+   if (need > handle->rxlen)
+   {                            // Make sure we have enough space
+      int len = (need > LWMQTT_RX ? need : LWMQTT_RX);
+      unsigned char *n = realloc (handle->rx, len + 1); // One more to allow extra null on end in all cases
+      if (!n)
+      {
+         ESP_LOGE (TAG, "realloc fail %d", need);
+         return -1;
       }
-      pos = 0;
+      handle->rx = n;
+      handle->rxlen = len;
+   }
+   int got = hread (handle, handle->rx + handle->rxend, handle->rxlen - handle->rxend);
+   if (got <= 0)
+   {
+      ESP_LOGI (TAG, "Connection closed");
+      return -1;                // Error or close
+   }
+   handle->rxend += got;
+   return got;
+}
+
+static int
+lwmqtt_tick (lwmqtt_t handle)
+{                               // Send queued, and keep alive, returns -1 if timed out
+   if (handle->qhead)
+      lwmqtt_queue_send (handle);
+   if (handle->qosunsent && handle->connected && handle->inflight < handle->window)
+      lwmqtt_qos_send (handle);
+   uint32_t now = uptime ();
+   if (now >= handle->ka)
+   {
+      if (handle->server)
+         return -1;             // timeout
+      // client, so send ping - do so regularly regardless as we want pingresp regularly to detect down as a client.
+      uint8_t b[] = { 0xC0, 0x00 };     // Ping
+      xSemaphoreTake (handle->mutex, portMAX_DELAY);
+      hwrite (handle, b, sizeof (b));
+      xSemaphoreGive (handle->mutex);
+      handle->ka = uptime () + handle->keepalive;       // Client KA next
+      handle->kacheck = uptime () + 10; // Expect KA resp
+   } else if (handle->kacheck && handle->kacheck < now)
+   {                            // only set for client anyway
+      ESP_LOGE (TAG, "KA fail");
+      return -1;
    }
+   return 0;
+}
+
+static void
+lwmqtt_loop_end (lwmqtt_t handle)
+{                               // Connection done
    handle->connected = 0;
-   freez (buf);
+   freez (handle->rx);
+   handle->rxlen = 0;
+   xSemaphoreTake (handle->mutex, portMAX_DELAY);       // Not while sending, e.g. streaming
    if (!handle->server && (handle->close || !handle->running))
    {                            // Close connection - as was clean
       ESP_LOGE (TAG, "Closed cleanly%s", handle->close ? " to reconnect" : "");
       uint8_t b[] = { 0xE0, 0x00 };     // Disconnect cleanly
-      xSemaphoreTake (handle->mutex, portMAX_DELAY);
       hwrite (handle, b, sizeof (b));
-      xSemaphoreGive (handle->mutex);
    }
    handle_close (handle);
+   xSemaphoreGive (handle->mutex);
    handle->close = 0;
+   lwmqtt_queue_fail (handle, "Not connected");
+   lwmqtt_qos_resend (handle);
    if (handle->callback)
       handle->callback (handle->arg, NULL, 0, NULL);
 }
 
+#if	!defined(CONFIG_REVK_MQTT_ONETASK) || defined(CONFIG_REVK_MQTT_SERVER)
 static void
-client_task (void *pvParameters)
+lwmqtt_loop (lwmqtt_t handle)
 {
-   lwmqtt_t handle = pvParameters;
-   if (!handle)
-   {
-      vTaskDelete (NULL);
-      return;
-   }
-   handle->backoff = 0;
-   while (handle->running)
-   {                            // Loop connecting and trying repeatedly
-      handle->sock = -1;
-      char *hostname = strdup (handle->hostname);
-      uint16_t port = handle->port;
-      {                         // Port suffix
-         char *p = hostname + strlen (hostname);
-         while (p > hostname && p[-1] >= '0' && p[-1] <= '9')
-            p--;
-         if (p > hostname && *p > '0' && *p <= '9' && p[-1] == ':')
+   // Handle rx messages, reading as much as available in to rx, and handling all whole messages in it
+   lwmqtt_loop_start (handle);
+   while (handle->running && !handle->close)
+   {                            // Loop handling messages received, and timeouts
+      int r = lwmqtt_message (handle);
+      if (r < 0)
+         break;
+      if (r)
+         continue;
+      if (lwmqtt_tick (handle) < 0)
+         break;
+      if (!handle->tls || esp_tls_get_bytes_avail (handle->tls) <= 0)
+      {                         // Wait for data to arrive
+         fd_set r,
+           e;
+         FD_ZERO (&r);
+         FD_SET (handle->sock, &r);
+         if (handle->wake >= 0)
+            FD_SET (handle->wake, &r);
+         FD_ZERO (&e);
+         FD_SET (handle->sock, &e);
+         struct timeval to = { 1, 0 };  // Keeps us checking running but is light load at once a second
+         int sel = select ((handle->wake > handle->sock ? handle->wake : handle->sock) + 1, &r, NULL, &e, &to);
+         if (sel < 0)
          {
-            port = atoi (p);
-            *--p = 0;
+            ESP_LOGE (TAG, "Select failed");
+            break;
+         }
+         if (FD_ISSET (handle->sock, &e))
+         {
+            ESP_LOGE (TAG, "Closed");
+            break;
          }
+         if (handle->wake >= 0 && FD_ISSET (handle->wake, &r))
+         {                      // Queued
+            uint8_t b[16];
+            while (recv (handle->wake, b, sizeof (b), 0) > 0);
+         }
+         if (!FD_ISSET (handle->sock, &r))
+            continue;           // Nothing waiting
       }
-      // Connect
-      ESP_LOGI (TAG, "Connecting %s:%d", hostname, port);
-      // Can connect using TLS or non TLS with just sock set instead
-      if (revk_has_ip ())
+      if (lwmqtt_read (handle) < 0)
+         break;
+   }
+   lwmqtt_loop_end (handle);
+}
+#endif
+
+static int
+lwmqtt_connect (lwmqtt_t handle)
+{                               // Connect (blocking) and send connect message, returns 1 if connected
+   handle->sock = -1;
+   char *hostname = strdup (handle->hostname);
+   uint16_t port = handle->port;
+   {                            // Port suffix
+      char *p = hostname + strlen (hostname);
+      while (p > hostname && p[-1] >= '0' && p[-1] <= '9')
+         p--;
+      if (p > hostname && *p > '0' && *p <= '9' && p[-1] == ':')
       {
-         if (handle->ca_cert_bytes || handle->crt_bundle_attach)
+         port = atoi (p);
+         *--p = 0;
+      }
+   }
+   // Connect
+   ESP_LOGI (TAG, "Connecting %s:%d", hostname, port);
+   // Can connect using TLS or non TLS with just sock set instead
+   if (revk_has_ip ())
+   {
+      if (handle->ca_cert_bytes || handle->crt_bundle_attach)
+      {
+         int tryconnect (uint8_t ip6)
          {
-            int tryconnect (uint8_t ip6)
+            if (handle->sock >= 0)
+               return 1;        // connected already
+            esp_tls_t *tls = NULL;
+            esp_tls_cfg_t cfg = {
+               .cacert_buf = handle->ca_cert_buf,
+               .cacert_bytes = handle->ca_cert_bytes,
+               .common_name = handle->tlsname,
+               .clientcert_buf = handle->our_cert_buf,
+               .clientcert_bytes = handle->our_cert_bytes,
+               .clientkey_buf = handle->our_key_buf,
+               .clientkey_bytes = handle->our_key_bytes,
+               .crt_bundle_attach = handle->crt_bundle_attach,
+               .addr_family = (ip6 ? ESP_TLS_AF_INET6 : ESP_TLS_AF_INET),
+            };
+            tls = esp_tls_init ();
+            if (esp_tls_conn_new_sync (hostname, strlen (hostname), port, &cfg, tls) != 1)
             {
-               if (handle->sock >= 0)
-                  return 1;     // connected already
-               esp_tls_t *tls = NULL;
-               esp_tls_cfg_t cfg = {
-                  .cacert_buf = handle->ca_cert_buf,
-                  .cacert_bytes = handle->ca_cert_bytes,
-                  .common_name = handle->tlsname,
-                  .clientcert_buf = handle->our_cert_buf,
-                  .clientcert_bytes = handle->our_cert_bytes,
-                  .clientkey_buf = handle->our_key_buf,
-                  .clientkey_bytes = handle->our_key_bytes,
-                  .crt_bundle_attach = handle->crt_bundle_attach,
-                  .addr_family = (ip6 ? ESP_TLS_AF_INET6 : ESP_TLS_AF_INET),
-               };
-               tls = esp_tls_init ();
-               if (esp_tls_conn_new_sync (hostname, strlen (hostname), port, &cfg, tls) != 1)
-               {
-                  free (tls);
-                  return 0;
-               }
-               handle->tls = tls;
-               esp_tls_get_conn_sockfd (handle->tls, &handle->sock);
-               if (ip6)
-               {
-                  handle->ipv6 = 1;
-                  handle->close = 0;
-               }
-               return 1;
+               free (tls);
+               return 0;
             }
-            tryconnect (1);     // Explicit try IPv6 first
-            tryconnect (0);
-         } else
-         {                      // Non TLS
-            char sport[6];
-            snprintf (sport, sizeof (sport), "%d", port);
-            int tryconnect (uint8_t ip6)
+            handle->tls = tls;
+            esp_tls_get_conn_sockfd (handle->tls, &handle->sock);
+            if (ip6)
+            {
+               handle->ipv6 = 1;
+               handle->close = 0;
+            }
+            return 1;
+         }
+         tryconnect (1);        // Explicit try IPv6 first
+         tryconnect (0);
+      } else
+      {                         // Non TLS
+         char sport[6];
+         snprintf (sport, sizeof (sport), "%d", port);
+         int tryconnect (uint8_t ip6)
+         {
+            if (handle->sock >= 0)
+               return 1;        // connected already
+          struct addrinfo base = { ai_family: ip6 ? AF_INET6 : AF_INET, ai_socktype:SOCK_STREAM };
+            struct addrinfo *a = 0,
+               *p = NULL;
+            if (!getaddrinfo (hostname, sport, &base, &a) && a)
             {
-               if (handle->sock >= 0)
-                  return 1;     // connected already
-             struct addrinfo base = { ai_family: ip6 ? AF_INET6 : AF_INET, ai_socktype:SOCK_STREAM };
-               struct addrinfo *a = 0,
-                  *p = NULL;
-               if (!getaddrinfo (hostname, sport, &base, &a) && a)
-               {
 #if 0                           // Debug log the getaddrinfo result - it seems UNSPEC after say IP6 give only IP6,so we need to check 6 and 4 separately
-                  ESP_LOGE (TAG, "getaddrinfo %s %s", ip6 ? "IPv6" : "IPv4", hostname);
-                  for (p = a; p; p = p->ai_next)
-                  {
+               ESP_LOGE (TAG, "getaddrinfo %s %s", ip6 ? "IPv6" : "IPv4", hostname);
+               for (p = a; p; p = p->ai_next)
+               {
+                  char from[INET6_ADDRSTRLEN + 1] = "";
+                  if (p->ai_family == AF_INET)
+                     inet_ntop (p->ai_family, &((struct sockaddr_in *) (p->ai_addr))->sin_addr, from, sizeof (from));
+                  else
+                     inet_ntop (p->ai_family, &((struct sockaddr_in6 *) (p->ai_addr))->sin6_addr, from, sizeof (from));
+                  ESP_LOGE (TAG, "%s", from);
+               }
+#endif
+               for (p = a; p && !handle->dnsipv6; p = p->ai_next)
+                  if (p->ai_family == AF_INET6)
+                     handle->dnsipv6 = 1;
+               for (p = a; p; p = p->ai_next)
+               {
+                  if (p->ai_family == AF_INET && (ip6 || !revk_has_ipv4 ()))
+                     continue;
+                  if (p->ai_family == AF_INET6 && (!ip6 || !revk_has_ipv6 ()))
+                     continue;
+                  handle->sock = socket (p->ai_family, p->ai_socktype, p->ai_protocol);
+                  if (handle->sock < 0)
+                     continue;
+#if 0
+                  {             // Debug that we are trying
                      char from[INET6_ADDRSTRLEN + 1] = "";
                      if (p->ai_family == AF_INET)
                         inet_ntop (p->ai_family, &((struct sockaddr_in *) (p->ai_addr))->sin_addr, from, sizeof (from));
                      else
                         inet_ntop (p->ai_family, &((struct sockaddr_in6 *) (p->ai_addr))->sin6_addr, from, sizeof (from));
-                     ESP_LOGE (TAG, "%s", from);
+                     ESP_LOGE (TAG, "Try connect %s (backoff %d)", from, handle->backoff);
                   }
 #endif
-                  for (p = a; p && !handle->dnsipv6; p = p->ai_next)
-                     if (p->ai_family == AF_INET6)
-                        handle->dnsipv6 = 1;
-                  for (p = a; p; p = p->ai_next)
+                  if (connect (handle->sock, p->ai_addr, p->ai_addrlen))
                   {
-                     if (p->ai_family == AF_INET && (ip6 || !revk_has_ipv4 ()))
-                        continue;
-                     if (p->ai_family == AF_INET6 && (!ip6 || !revk_has_ipv6 ()))
-                        continue;
-                     handle->sock = socket (p->ai_family, p->ai_socktype, p->ai_protocol);
-                     if (handle->sock < 0)
-                        continue;
-#if 0
-                     {          // Debug that we are trying
-                        char from[INET6_ADDRSTRLEN + 1] = "";
-                        if (p->ai_family == AF_INET)
-                           inet_ntop (p->ai_family, &((struct sockaddr_in *) (p->ai_addr))->sin_addr, from, sizeof (from));
-                        else
-                           inet_ntop (p->ai_family, &((struct sockaddr_in6 *) (p->ai_addr))->sin6_addr, from, sizeof (from));
-                        ESP_LOGE (TAG, "Try connect %s (backoff %d)", from, handle->backoff);
-                     }
-#endif
-                     if (connect (handle->sock, p->ai_addr, p->ai_addrlen))
-                     {
-                        close (handle->sock);
-                        handle->sock = -1;
-                        continue;
-                     }
-                     // Connected
-                     if (ip6)
-                     {          // IPv6 connected
-                        handle->ipv6 = 1;       // Is IPv6
-                        handle->close = 0;      // We only close to force IPv6, so cancel closing
-                     }
-                     break;
+                     close (handle->sock);
+                     handle->sock = -1;
+                     continue;
+                  }
+                  // Connected
+                  if (ip6)
+                  {             // IPv6 connected
+                     handle->ipv6 = 1;  // Is IPv6
+                     handle->close = 0;         // We only close to force IPv6, so cancel closing
                   }
+                  break;
                }
-               if (a)
-                  freeaddrinfo (a);
-               if (handle->sock < 0)
-                  return 0;     // Not  connected
-               return 1;        // Worked
             }
-            tryconnect (1);     // Explicit try IPv6 first
-            tryconnect (0);
+            if (a)
+               freeaddrinfo (a);
+            if (handle->sock < 0)
+               return 0;        // Not  connected
+            return 1;           // Worked
          }
+         tryconnect (1);        // Explicit try IPv6 first
+         tryconnect (0);
       }
-      if (handle->backoff < 10)
-         handle->backoff++;     // 100 seconds max
-      if (!revk_has_ip ())
-         handle->backoff = 0;   // We did not try even
-      else if (handle->sock < 0)
-      {                         // Failed before we even start
-         ESP_LOGI (TAG, "Could not connect to %s:%d", hostname, port);
-         if (handle->callback)
-            handle->callback (handle->arg, NULL, 0, NULL);
-      } else
+   }
+   int ok = 0;
+   if (handle->backoff < 10)
+      handle->backoff++;        // 100 seconds max
+   if (!revk_has_ip ())
+      handle->backoff = 0;      // We did not try even
+   else if (handle->sock < 0)
+   {                            // Failed before we even start
+      ESP_LOGI (TAG, "Could not connect to %s:%d", hostname, port);
+      if (handle->callback)
+         handle->callback (handle->arg, NULL, 0, NULL);
+   } else
+   {
+      ESP_LOGE (TAG, "Connected %s:%d%s", hostname, port, handle->ipv6 ? " (IPv6)" : handle->dnsipv6 ? " (Not IPv6)" : "");
+      hwrite (handle, handle->connect, handle->connectlen);
+      ok = 1;
+   }
+   free (hostname);
+   return ok;
+}
+
+static void
+lwmqtt_disconnected (lwmqtt_t handle)
+{                               // After a connection, ready to reconnect
+   handle->backoff = 0;
+   handle->dnsipv6 = 0;
+   handle->ipv6 = 0;
+}
+
+#ifdef	CONFIG_REVK_MQTT_ONETASK
+static void
+io_closed (lwmqtt_t h)
+{                               // Connection done, retry shortly if still running
+   lwmqtt_loop_end (h);
+   lwmqtt_disconnected (h);
+   h->retry = esp_timer_get_time () + 100000LL;
+}
+
+static void
+io_task (void *pvParameters)
+{                               // One task handling all client connections
+   while (1)
+   {
+      lwmqtt_t list = NULL;
+      int64_t now = esp_timer_get_time ();
+      int64_t due = now + 60000000LL;   // Next timer, waiting for wake if nothing else
+      fd_set r,
+        e;
+      FD_ZERO (&r);
+      FD_ZERO (&e);
+      int max = io_wake;
+      if (io_wake >= 0)
+         FD_SET (io_wake, &r);
+      xSemaphoreTake (io_mutex, portMAX_DELAY);
+      list = io_list;
+      xSemaphoreGive (io_mutex);
+      for (lwmqtt_t h = list, next = NULL; h; h = next)
+      {
+         next = h->next;
+         if (h->sock < 0)
+         {                      // Not connected
+            if (!h->running)
+            {                   // Ended
+               xSemaphoreTake (io_mutex, portMAX_DELAY);
+               lwmqtt_t *hp = &io_list;
+               while (*hp && *hp != h)
+                  hp = &(*hp)->next;
+               if (*hp)
+                  *hp = h->next;
+               xSemaphoreGive (io_mutex);
+               handle_free (h);
+               continue;
+            }
+            if (now >= h->retry)
+            {                   // Connect (blocking)
+               if (lwmqtt_connect (h))
+                  lwmqtt_loop_start (h);
+               else
+               {
+                  ESP_LOGI (TAG, "Retry %d (mem:%ld)", h->backoff, (long) esp_get_free_heap_size ());
+                  h->retry = esp_timer_get_time () + (100000LL << h->backoff);
+               }
+               now = esp_timer_get_time ();
+            }
+            if (h->sock < 0)
+            {
+               if (h->retry < due)
+                  due = h->retry;
+               continue;
+            }
+         }
+         // Connected
+         int m = 0;
+         if (h->running && !h->close)
+            while ((m = lwmqtt_message (h)) > 0);
+         if (!h->running || h->close || m < 0 || lwmqtt_tick (h) < 0)
+         {
+            io_closed (h);
+            if (h->retry < due)
+               due = h->retry;
+            continue;
+         }
+         if (h->tls && esp_tls_get_bytes_avail (h->tls) > 0)
+            due = now;          // Already have data
+         uint32_t t = (h->kacheck && h->kacheck < h->ka ? h->kacheck + 1 : h->ka);
+         uint32_t u = uptime ();
+         int64_t d = now + (t > u ? (int64_t) (t - u) * 1000000LL : 0);
+         if (d < due)
+            due = d;
+         FD_SET (h->sock, &r);
+         FD_SET (h->sock, &e);
+         if (h->sock > max)
+            max = h->sock;
+      }
+      int64_t wait = due - esp_timer_get_time ();
+      if (wait < 0)
+         wait = 0;
+      struct timeval to = { wait / 1000000LL, wait % 1000000LL };
+      if (select (max + 1, &r, NULL, &e, &to) < 0)
+      {
+         ESP_LOGE (TAG, "Select failed");
+         usleep (100000);
+         continue;
+      }
+      if (io_wake >= 0 && FD_ISSET (io_wake, &r))
+      {                         // Woken
+         uint8_t b[16];
+         while (recv (io_wake, b, sizeof (b), 0) > 0);
+      }
+      xSemaphoreTake (io_mutex, portMAX_DELAY);
+      list = io_list;           // Ended ones removed, any new ones are not connected
+      xSemaphoreGive (io_mutex);
+      for (lwmqtt_t h = list; h; h = h->next)
+      {
+         if (h->sock < 0)
+            continue;
+         if (FD_ISSET (h->sock, &e))
+         {
+            ESP_LOGE (TAG, "Closed");
+            io_closed (h);
+         } else if ((FD_ISSET (h->sock, &r) || (h->tls && esp_tls_get_bytes_avail (h->tls) > 0)) && lwmqtt_read (h) < 0)
+            io_closed (h);
+      }
+   }
+}
+
+static int
+io_init (void)
+{                               // Start I/O task, only once even if called from several tasks, returns 0 if running
+   uint8_t s = 0;
+   if (__atomic_compare_exchange_n (&io_state, &s, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+   {                            // We are first, so start it
+      TaskHandle_t task_id = NULL;
+      if ((io_mutex = xSemaphoreCreateBinary ()))
+         xSemaphoreGive (io_mutex);
+      if (io_mutex && (io_wake = lwmqtt_wake_socket ()) >= 0
+          && xTaskCreate (io_task, "mqtt-io", 4 * 1024, NULL, 2, &task_id) == pdPASS)
+         s = 2;
+      else
+      {                         // Failed, clean up so can try again
+         ESP_LOGE (TAG, "MQTT I/O task failed");
+         if (io_wake >= 0)
+            close (io_wake);
+         io_wake = -1;
+         if (io_mutex)
+            vSemaphoreDelete (io_mutex);
+         io_mutex = NULL;
+      }
+      __atomic_store_n (&io_state, s, __ATOMIC_RELEASE);
+   } else
+      while ((s = __atomic_load_n (&io_state, __ATOMIC_ACQUIRE)) == 1)
+         usleep (10000);        // Another task is starting it
+   return s == 2 ? 0 : -1;
+}
+
+static int
+io_add (lwmqtt_t handle)
+{                               // Add client to I/O task, returns 0 if added
+   if (io_init ())
+      return -1;
+   xSemaphoreTake (io_mutex, portMAX_DELAY);
+   handle->next = io_list;
+   io_list = handle;
+   xSemaphoreGive (io_mutex);
+   lwmqtt_wake (handle);
+   return 0;
+}
+#else
+static void
+client_task (void *pvParameters)
+{
+   lwmqtt_t handle = pvParameters;
+   if (!handle)
+   {
+      vTaskDelete (NULL);
+      return;
+   }
+   handle->backoff = 0;
+   while (handle->running)
+   {                            // Loop connecting and trying repeatedly
+      if (lwmqtt_connect (handle))
       {
-         ESP_LOGE (TAG, "Connected %s:%d%s", hostname, port, handle->ipv6 ? " (IPv6)" : handle->dnsipv6 ? " (Not IPv6)" : "");
-         hwrite (handle, handle->connect, handle->connectlen);
          lwmqtt_loop (handle);
-         handle->backoff = 0;
-         handle->dnsipv6 = 0;
-         handle->ipv6 = 0;
+         lwmqtt_disconnected (handle);
       }
-      free (hostname);
       // On ESP32 uint32_t, returned by this func, appears to be long, while on ESP8266 it's a pure unsigned int
       // The easiest and least ugly way to get around is to cast to long explicitly
       ESP_LOGI (TAG, "Retry %d (mem:%ld)", handle->backoff, (long) esp_get_free_heap_size ());
@@ -873,6 +1769,7 @@ client_task (void *pvParameters)
    handle_free (handle);
    vTaskDelete (NULL);
 }
+#endif
 
 #ifdef	CONFIG_REVK_MQTT_SERVER
 static void
@@ -915,8 +1812,10 @@ listen_task (void *pvParameters)
                if (!h)
                   break;
                memset (h, 0, sizeof (*h));
+               h->wake = -1;
                h->port = handle->port;  // Only for debugging
                h->callback = handle->callback;
+               h->rxmax = handle->rxmax;
                h->arg = h;
                h->mutex = xSemaphoreCreateBinary ();
                h->server = 1;
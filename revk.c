@@ -326,13 +326,17 @@ static void ap_stop (void);     // Stop AP mode, allowed if if not running
 #endif
 
 static void ip_event_handler (void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
-static void mqtt_rx (void *arg, char *topic, unsigned short plen, unsigned char *payload);
+static void mqtt_rx (void *arg, char *topic, int plen, unsigned char *payload);
 static const char *revk_upgrade (const char *target, jo_t j);
 
 #ifdef	CONFIG_REVK_MESH
 static void mesh_init (void);
 void mesh_make_mqtt (mesh_data_t * data, uint8_t tag, int tlen, const char *topic, int plen, const unsigned char *payload);
 static SemaphoreHandle_t mesh_mutex = NULL;
+#define	MESH_MQTT_CBOR	0x40    // Tag bit, to root, payload is JSON sent as CBOR
+#if	defined(CONFIG_REVK_MESH_CBOR) && CONFIG_REVK_MQTT_CLIENTS > 6
+#error	CONFIG_REVK_MESH_CBOR uses MQTT client bit 6
+#endif
 #endif
 
 void *
@@ -559,7 +563,8 @@ mesh_task (void *pvParameters)
                if (ota_percent != ota_progress && (ota_percent == 100 || next < now || ota_percent / 10 != ota_progress / 10))
                {
                   ESP_LOGI (TAG, "Flash %d%%", ota_percent);
-                  jo_t j = jo_make (NULL);
+                  jo_cursor_t jc;
+                  jo_t j = jo_make_in (&jc, NULL);
                   jo_int (j, "size", ota_size);
                   jo_int (j, "loaded", ota_data);
                   jo_int (j, "progress", ota_progress = ota_percent);
@@ -615,9 +620,25 @@ mesh_task (void *pvParameters)
          {                      // To root: tag is client bit map of which external MQTT server to send to
             if (memcmp (from.addr, revk_mac, 6))
             {                   // From us is exception, we would have sent direct
+               jo_t j = NULL;
+               int plen = e - payload;
+#if	CONFIG_REVK_MQTT_CLIENTS <= 6
+               if (tag & MESH_MQTT_CBOR)
+               {                // Back to JSON for MQTT
+                  j = jo_parse_cbor (payload, plen);
+                  if (!(payload = (char *) jo_rewind (j)))
+                  {
+                     ESP_LOGE (TAG, "Mesh Rx bad CBOR %s: %s", mac, jo_error (j, NULL));
+                     jo_free (&j);
+                     continue;
+                  }
+                  plen = strlen (payload);
+               }
+#endif
                for (int client = 0; client < CONFIG_REVK_MQTT_CLIENTS; client++)
                   if (tag & (1 << client))
-                     lwmqtt_send_full (mqtt_client[client], -1, topic, e - payload, (void *) payload, tag >> 7);        // Out
+                     lwmqtt_send_full (mqtt_client[client], -1, topic, plen, (void *) payload, tag >> 7);       // Out
+               jo_free (&j);
             }
          } else
          {                      // To leaf: tag is client ID
@@ -628,8 +649,15 @@ mesh_task (void *pvParameters)
       {                         // Internal message
          if (mesh_decode (&from, &data))
             continue;
-         ESP_LOGD (TAG, "Mesh Rx JSON %s: %.*s", mac, data.size, (char *) data.data);
-         jo_t j = jo_parse_mem (data.data, data.size + 1);      // Include the null
+         jo_cursor_t jc;
+         jo_t j;
+         if (data.size && *data.data >= 0x80)
+            j = jo_parse_cbor (data.data, data.size);   // CBOR (indefinite map/array), converted back to JSON
+         else
+         {
+            ESP_LOGD (TAG, "Mesh Rx JSON %s: %.*s", mac, data.size, (char *) data.data);
+            j = jo_parse_mem_in (&jc, data.data, data.size + 1);        // Include the null
+         }
          if (app_callback)
             app_callback (0, "mesh", mac, NULL, j);
          jo_free (&j);
@@ -887,9 +915,9 @@ mesh_init (void)
 #endif
 
 #ifdef	CONFIG_REVK_MQTT
-char *
-revk_topic (const char *name, const char *id, const char *suffix)
-{                               // Construct a topic, malloc'd and return pointer to it
+int
+revk_topic_buf (char *buf, int size, const char *name, const char *id, const char *suffix)
+{                               // Construct a topic in buf, returns length (which may be size or more if not enough space, as snprintf)
    if (!id)
       id = hostname;
    if (!*id)
@@ -915,15 +943,24 @@ revk_topic (const char *name, const char *id, const char *suffix)
    }
    if (suffix)
       t[tn++] = suffix;
-   char *topic = NULL;
    if (t[3])
-      asprintf (&topic, "%s/%s/%s/%s", t[0], t[1], t[2], t[3]);
-   else if (t[2])
-      asprintf (&topic, "%s/%s/%s", t[0], t[1], t[2]);
-   else if (t[1])
-      asprintf (&topic, "%s/%s", t[0], t[1]);
-   else
-      asprintf (&topic, "%s", t[0]);
+      return snprintf (buf, size, "%s/%s/%s/%s", t[0], t[1], t[2], t[3]);
+   if (t[2])
+      return snprintf (buf, size, "%s/%s/%s", t[0], t[1], t[2]);
+   if (t[1])
+      return snprintf (buf, size, "%s/%s", t[0], t[1]);
+   return snprintf (buf, size, "%s", t[0] ? : "");
+}
+
+char *
+revk_topic (const char *name, const char *id, const char *suffix)
+{                               // Construct a topic, malloc'd and return pointer to it
+   int len = revk_topic_buf (NULL, 0, name, id, suffix);
+   if (len < 0)
+      return NULL;
+   char *topic = mallocspi (len + 1);
+   if (topic)
+      revk_topic_buf (topic, len + 1, name, id, suffix);
    return topic;
 }
 #endif
@@ -969,7 +1006,7 @@ revk_send_subunsub (int client, const mac_t mac, uint8_t sub)
 
 #ifdef	CONFIG_REVK_MQTT
 static void
-mqtt_rx (void *arg, char *topic, unsigned short plen, unsigned char *payload)
+mqtt_rx (void *arg, char *topic, int plen, unsigned char *payload)
 {                               // Expects to be able to write over topic
    int client = (int) arg;
    if (client < 0 || client >= CONFIG_REVK_MQTT_CLIENTS)
@@ -1063,6 +1100,7 @@ mqtt_rx (void *arg, char *topic, unsigned short plen, unsigned char *payload)
       if (!target)
          target = "?";
 
+      jo_cursor_t jc;
       jo_t j = NULL;
       if (plen)
       {
@@ -1070,12 +1108,12 @@ mqtt_rx (void *arg, char *topic, unsigned short plen, unsigned char *payload)
          {                      // Looks like non JSON
             if (prefix && suffix && !strcmp (prefix, topicsetting))
             {                   // Special case for settings, the suffix is the setting
-               j = jo_object_alloc ();
+               j = jo_object_alloc_in (&jc);
                jo_stringf (j, suffix, "%.*s", plen, payload);
                suffix = NULL;
             } else
             {                   // Just JSON the argument
-               j = jo_create_alloc ();
+               j = jo_create_alloc_in (&jc);
                int q = 0;
                if ((plen == 4 && !memcmp (payload, "true", plen)) || (plen == 5 && !memcmp (payload, "false", plen)))
                   q += plen;    // Boolean
@@ -1100,8 +1138,8 @@ mqtt_rx (void *arg, char *topic, unsigned short plen, unsigned char *payload)
             }
          } else
          {                      // Parse JSON argument
-            j = jo_parse_mem (payload, plen + 1);       // +1 as we can trust a trailing NULL from lwmqtt
-            jo_skip (j);        // Check whole JSON
+            j = jo_parse_mem_in (&jc, payload, plen + 1);       // +1 as we can trust a trailing NULL from lwmqtt
+            jo_validate (j);    // Check whole JSON
             int pos;
             err = jo_error (j, &pos);
             if (err)
@@ -1237,6 +1275,10 @@ revk_mqtt_init (void)
             .plen = -1,
             .keepalive = 30,
             .callback = &mqtt_rx,
+            .queue = CONFIG_REVK_MQTT_QUEUE,
+            .queue_old = 1,
+            .window = CONFIG_REVK_MQTT_WINDOW,
+            .rxmax = CONFIG_REVK_MQTT_RXMAX,
          };
          // LWT Topic
          if (!(config.topic = revk_topic (topicstate, NULL, NULL)))
@@ -2033,7 +2075,8 @@ task (void *pvParameters)
             {
                if (restart_time && ota_task_id)
                   restart_time++;       // wait
-               jo_t j = jo_make (NULL);
+               jo_cursor_t jc;
+               jo_t j = jo_make_in (&jc, NULL);
                jo_string (j, "id", revk_id);
                jo_bool (j, "up", 1);
                jo_int (j, "uptime", now);
@@ -2621,6 +2664,22 @@ revk_mesh_send_json (const mac_t mac, jo_t * jp)
       ESP_LOGE (TAG, "JO Pad failed");
       return;
    }
+#ifdef	CONFIG_REVK_MESH_CBOR
+   jo_t c = jo_create_alloc ();
+   jo_cbor (c);
+   jo_json (c, NULL, j);
+   jo_free (jp);
+   int len = jo_len (c);
+   c = jo_pad (&c, MESH_PAD);   // Ensures MESH_PAD on end of CBOR
+   uint8_t *cbor = (uint8_t *) jo_finisha (&c);
+   if (cbor)
+   {
+      mesh_data_t data = {.proto = MESH_PROTO_JSON,.data = cbor,.size = len };
+      mesh_encode_send ((void *) mac, &data, MESH_DATA_P2P);    // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
+      free (cbor);
+   }
+   return;
+#endif
    const char *json = jo_rewind (j);
    if (json)
    {
@@ -2646,10 +2705,32 @@ revk_mqtt_out (uint8_t clients, int tlen, const char *topic, int plen, const uns
 #ifdef	CONFIG_REVK_MESH
    if (esp_mesh_is_device_active () && !esp_mesh_is_root ())
    {                            // Send via mesh
+      char *cbor = NULL;
+#ifdef	CONFIG_REVK_MESH_CBOR
+      if (plen < 0)
+         plen = strlen ((char *) payload);
+      if (plen && (*payload == '{' || *payload == '['))
+      {                         // JSON, send as CBOR if smaller, root converts back
+         jo_cursor_t jc;
+         jo_t j = jo_parse_mem_in (&jc, payload, plen);
+         jo_t c = jo_create_alloc ();
+         jo_cbor (c);
+         jo_json (c, NULL, j);
+         jo_free (&j);
+         int len = jo_len (c);
+         if ((cbor = jo_finisha (&c)) && len < plen)
+         {
+            payload = (void *) cbor;
+            plen = len;
+            clients |= MESH_MQTT_CBOR;
+         }
+      }
+#endif
       mesh_data_t data = {.proto = MESH_PROTO_MQTT };
       mesh_make_mqtt (&data, clients | (retain << 7), tlen, topic, plen, payload);      // Ensures MESH_PAD space one end
       mesh_encode_send (NULL, &data, 0);        // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
       freez (data.data);
+      freez (cbor);
       return NULL;
    }
 #endif
@@ -2661,6 +2742,45 @@ revk_mqtt_out (uint8_t clients, int tlen, const char *topic, int plen, const uns
 }
 #endif
 
+#ifdef	CONFIG_REVK_MQTT
+static const char *
+revk_mqtt_out_head (uint8_t clients, int head, int tlen, const char *topic, int plen, unsigned char *payload, char retain)
+{                               // As revk_mqtt_out, but payload has head bytes free in front (and MESH_PAD after if mesh) so header is added in place
+   if (!clients)
+      return NULL;
+   if (link_down)
+      return "Link down";
+   if (tlen < 0)
+      tlen = strlen (topic);
+   if (plen < 0)
+      plen = strlen ((char *) payload);
+#ifdef	CONFIG_REVK_MESH
+   if (esp_mesh_is_device_active () && !esp_mesh_is_root ())
+   {                            // Send via mesh
+#ifndef	CONFIG_REVK_MESH_CBOR
+      if (head >= 1 + tlen + 1)
+      {                         // Make the mesh MQTT header in place, as mesh_make_mqtt
+         unsigned char *p = payload - tlen - 2;
+         *p = clients | (retain << 7);
+         memcpy (p + 1, topic, tlen);
+         p[1 + tlen] = 0;
+         mesh_data_t data = {.proto = MESH_PROTO_MQTT,.data = p,.size = 1 + tlen + 1 + plen };
+         ESP_LOGD (TAG, "Mesh Tx MQTT%02X %.*s %.*s", *p, tlen, topic, plen, payload);
+         mesh_encode_send (NULL, &data, 0);     // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
+         return NULL;
+      }
+#endif
+      return revk_mqtt_out (clients, tlen, topic, plen, payload, retain);       // CBOR or no room
+   }
+#endif
+   const char *er = NULL;
+   for (int client = 0; client < CONFIG_REVK_MQTT_CLIENTS && !er; client++)
+      if (clients & (1 << client))
+         er = lwmqtt_send_head (mqtt_client[client], head, tlen, topic, plen, payload, retain);
+   return er;
+}
+#endif
+
 const char *
 revk_mqtt_send_raw (const char *topic, int retain, const char *payload, uint8_t clients)
 {
@@ -2742,10 +2862,41 @@ revk_mqtt_send_clients (const char *prefix, int retain, const char *suffix, jo_t
          free (payload);
       } else if (jo_isalloc (*jp))
       {
+#ifdef	CONFIG_REVK_MQTT
+#ifdef	CONFIG_REVK_MESH
+         if (!jo_pad (jp, MESH_PAD))    // Ensures MESH_PAD on end of JSON for mesh
+            return "JO Pad failed";
+#endif
+         size_t head = 0,
+            len = 0;
+         char *buf = jo_finish_head (jp, &head, &len);
+         if (buf)
+         {
+            char topic[REVK_TOPIC];
+            const char *t = topic;
+            int tlen = -1;
+            if (prefix)
+               tlen = revk_topic_buf (topic, sizeof (topic), prefix, NULL, suffix);
+            else if ((t = suffix))
+               tlen = strlen (t);       // Fixed topic
+            char *payload = buf + head;
+            if (tlen < 0)
+               err = "No topic";
+            else if (t == topic && tlen >= sizeof (topic))
+               err = revk_mqtt_send_payload_clients (prefix, retain, suffix, payload, clients); // Long topic
+            else
+            {
+               ESP_LOGD (TAG, "MQTT%02X publish %s (%s)", clients, t, payload);
+               err = revk_mqtt_out_head (clients, head, tlen, t, len, (void *) payload, retain);
+            }
+            free (buf);
+         }
+#else
          char *payload = jo_finisha (jp);
          if (payload)
             err = revk_mqtt_send_payload_clients (prefix, retain, suffix, payload, clients);
          freez (payload);
+#endif
       } else
       {                         // Static
          char *payload = jo_finish (jp);
@@ -2990,7 +3141,8 @@ revk_web_query (httpd_req_t * req)
       if (len > 0)
       {
          query[len] = 0;
-         j = jo_parse_query (query);
+         j = jo_parse_query_insitu (query, len);
+         query = NULL;          // Now owned by j
       }
    } else if (req->method == HTTP_GET)
    {
@@ -3003,7 +3155,8 @@ revk_web_query (httpd_req_t * req)
       if (!httpd_req_get_url_query_str (req, query, len + 1))
       {
          query[len] = 0;
-         j = jo_parse_query (query);
+         j = jo_parse_query_insitu (query, strlen (query));
+         query = NULL;          // Now owned by j
       }
    }
    free (query);
@@ -3335,13 +3488,23 @@ revk_web_settings (httpd_req_t * req)
    if (j)
    {
       const char *location = NULL;
-      if (j && jo_find (j, "_page"))
-      {
-         char t[4] = "";
-         jo_strncpy (j, t, sizeof (t));
+      char t[4] = "";
+      char ssid[33] = "";
+      char newpass[64] = "";
+      enum
+      { FIND_PAGE, FIND_UPGRADE, FIND_PASSWORD, FIND_WIFISSID, FIND_WIFIPASS, FIND_SAVE, FINDS };
+      jo_find_t f[FINDS] = {
+         [FIND_PAGE] = {.path = "_page",.dst = t,.len = sizeof (t) },
+         [FIND_UPGRADE] = {.path = "_upgrade" },
+         [FIND_PASSWORD] = {.path = "password" },
+         [FIND_WIFISSID] = {.path = "wifissid",.dst = ssid,.len = sizeof (ssid) },
+         [FIND_WIFIPASS] = {.path = "wifipass",.dst = newpass,.len = sizeof (newpass) },
+         [FIND_SAVE] = {.path = "_save" },
+      };
+      jo_find_many (j, f, FINDS);       // One pass for all we look for
+      if (f[FIND_PAGE].type)
          page = atoi (t);
-      }
-      if (jo_find (j, "_upgrade"))
+      if (f[FIND_UPGRADE].type)
       {
          const char *e = revk_settings_store (j, &location, REVK_SETTINGS_JSON_STRING); // Saved settings
          if (e && !*e && app_callback)
@@ -3351,7 +3514,7 @@ revk_web_settings (httpd_req_t * req)
          if (e && *e)
             revk_web_send (req, "<p class=error>%s</p>", e);
 #ifdef  CONFIG_REVK_SETTINGS_PASSWORD
-         else if (*password && jo_find (j, "password"))
+         else if (*password && f[FIND_PASSWORD].type)
             loggedin = 1;
 #endif
       } else
@@ -3361,19 +3524,17 @@ revk_web_settings (httpd_req_t * req)
          char ok = 0;
          if (mode == WIFI_MODE_STA)
             ok = 1;             // We don't test wifi if in STA mode as it kills the page load, D'Oh
-         else if (jo_find (j, "wifissid"))
+         else if (f[FIND_WIFISSID].type)
          {                      // Test WiFi
-            char ssid[33] = "";
             char pass[64] = "";
             strcpy (pass, wifipass);
-            jo_strncpy (j, ssid, sizeof (ssid));
             if (!*ssid)
                revk_web_send (req, "No WiFi SSID. ");
             else
             {
-               if (jo_find (j, "wifipass") == JO_STRING)
+               if (f[FIND_WIFIPASS].type == JO_STRING)
                {
-                  jo_strncpy (j, pass, sizeof (pass));
+                  strcpy (pass, newpass);
 #ifndef  CONFIG_REVK_OLD_SETTINGS
                   if (!strcmp (pass, revk_settings_secret))
                      strcpy (pass, wifipass);
@@ -3425,10 +3586,10 @@ revk_web_settings (httpd_req_t * req)
                   revk_web_send (req, "<p class=error>%s</p>", e);
             }
 #ifdef  CONFIG_REVK_SETTINGS_PASSWORD
-            else if (*password && jo_find (j, "password"))
+            else if (*password && f[FIND_PASSWORD].type)
                loggedin = 1;
 #endif
-            if (!e && jo_find (j, "_save"))
+            if (!e && f[FIND_SAVE].type)
                revk_web_send (req, "<script>document.location='/'</script>");
          }
       }
@@ -3759,7 +3920,8 @@ revk_web_status (httpd_req_t * req)
    }
    void msg (const char *msg)
    {
-      jo_t j = jo_create_alloc ();
+      jo_cursor_t jc;
+      jo_t j = jo_create_alloc_in (&jc);
       jo_string (j, NULL, msg);
       wsend (&j);
    }
@@ -3806,12 +3968,13 @@ revk_web_status (httpd_req_t * req)
       int n = revk_shutting_down (&r);
       if (n)
       {
-         jo_t j = jo_create_alloc ();
+         jo_cursor_t jc;
+         jo_t j = jo_create_alloc_in (&jc);
          jo_int (j, NULL, n);
          wsend (&j);
          if (ota_in_progress ())
          {
-            jo_t j = jo_create_alloc ();
+            jo_t j = jo_create_alloc_in (&jc);
             jo_stringf (j, NULL, "%s %d%%", r, ota_percent);
             wsend (&j);
          } else
@@ -4220,7 +4383,8 @@ ota_task (void *pvParameters)
                   if (ota_percent != ota_progress && (ota_percent == 100 || next < now || ota_percent / 10 != ota_progress / 10))
                   {
                      ESP_LOGI (TAG, "Flash %d%%", ota_percent);
-                     jo_t j = jo_make (NULL);
+                     jo_cursor_t jc;
+                     jo_t j = jo_make_in (&jc, NULL);
                      jo_int (j, "size", ota_size);
                      jo_int (j, "loaded", ota_data);
                      jo_int (j, "progress", ota_progress = ota_percent);
@@ -4696,7 +4860,17 @@ revk_shutting_down (const char **reason)
 jo_t
 jo_make (const char *node)
 {
-   jo_t j = jo_object_alloc ();
+   return jo_make_in (NULL, node);
+}
+
+jo_t
+jo_make_in (jo_cursor_t * c, const char *node)
+{
+   jo_t j = jo_create_alloc_in (c);
+#ifdef	CONFIG_REVK_MQTT
+   jo_head (j, REVK_HEAD);      // Room to add MQTT or mesh header in place when sent
+#endif
+   jo_object (j, NULL);
    time_t now = time (0);
    if (now > 1000000000)
       jo_datetime (j, "ts", now);
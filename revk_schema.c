@@ -0,0 +1,501 @@
+// Message schema generation tool
+// Makes a C struct, a serialise function (straight jo calls), and a parse function (one jo_find_many pass) for each message
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <popt.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "include/revk_ctype.h"
+
+typedef struct field_s field_t;
+struct field_s
+{
+   field_t *next;
+   char *define;                // # line
+   char *type;
+   char *name;                  // JSON path, dotted for objects
+   char *comment;
+};
+
+typedef struct msg_s msg_t;
+struct msg_s
+{
+   msg_t *next;
+   char *name;
+   char *comment;
+   field_t *fields,
+    *last;
+};
+
+typedef struct
+{                               // Type details
+   const char *type;            // Type in schema
+   const char *ctype;           // C type
+   int max;                     // Max JSON length of value, or 0 if not bounded
+   const char *put;             // jo function to add
+   const char *get;             // Parse helper (NULL for none)
+   const char *imin;            // Range for integer parse helper (NULL if whole of int64_t)
+   const char *imax;
+} type_t;
+
+static const type_t types[] = {
+   {"bit", "uint8_t", 5, "jo_bool", "bit"},
+   {"u8", "uint8_t", 3, "jo_int", "u8", "0", "UINT8_MAX"},
+   {"u16", "uint16_t", 5, "jo_int", "u16", "0", "UINT16_MAX"},
+   {"u32", "uint32_t", 10, "jo_int", "u32", "0", "UINT32_MAX"},
+   {"u64", "uint64_t", 20, "jo_litf", "u64"},   // Unsigned literal, as jo_int is signed
+   {"s8", "int8_t", 4, "jo_int", "s8", "INT8_MIN", "INT8_MAX"},
+   {"s16", "int16_t", 6, "jo_int", "s16", "INT16_MIN", "INT16_MAX"},
+   {"s32", "int32_t", 11, "jo_int", "s32", "INT32_MIN", "INT32_MAX"},
+   {"s64", "int64_t", 20, "jo_int", "s64"},
+   {"f", "double", 24, "jo_float", "f"},
+   {"time", "time_t", 22, "jo_datetime", "time"},
+   {"s", "const char *", 0, "jo_string", NULL},
+   {"c", "char", 0, "jo_stringn", "c"}, // cN, char[N+1], may be full without null
+   {"fixed", "double", 0, "jo_fixed", "f"},     // fN, N decimal places
+};
+
+static const type_t *
+gettype (const char *type, int *np)
+{                               // Find type, and N for cN or fN
+   *np = 0;
+   if ((*type == 'c' || *type == 'f') && is_digit (type[1]))
+   {
+      *np = atoi (type + 1);
+      type = (*type == 'c' ? "c" : "fixed");
+   }
+   for (int t = 0; t < sizeof (types) / sizeof (*types); t++)
+      if (!strcmp (types[t].type, type))
+         return &types[t];
+   return NULL;
+}
+
+static int
+valuemax (const type_t * t, int n)
+{                               // Max JSON length of value
+   if (t->max)
+      return t->max;
+   if (*t->type == 'c')
+      return 2 + n * 6;         // Worst case \u00XX for every character
+   if (!strcmp (t->type, "fixed"))
+      return 311 + n;           // Huge double with N places
+   return 0;
+}
+
+static void
+cname (FILE * O, const char *p, const char *e)
+{                               // JSON name to C name
+   while (p < e && *p)
+   {
+      fputc (is_alnum (*p) ? *p : '_', O);
+      p++;
+   }
+}
+
+static void
+member (FILE * O, const char *p)
+{                               // JSON path to C member
+   while (*p)
+   {
+      fputc (is_alnum (*p) || *p == '.' ? *p : '_', O);
+      p++;
+   }
+}
+
+typedef struct
+{                               // Tracking nesting of objects against # conditionals
+   int level;                   // Objects open
+   int depth;                   // # conditionals
+   const char *name[32];        // Name of each open object
+   int len[32];                 // Length of name
+   int at[32];                  // Conditional depth it was opened at
+} nest_t;
+
+static void
+gen (FILE * O, msg_t * m, int mode)
+{                               // Generate: 0=struct members, 1=serialise, 2=parse table
+   nest_t n = { 0 };
+   void indent (int extra)
+   {
+      for (int i = 0; i < n.level + extra; i++)
+         fprintf (O, "   ");
+   }
+   void close (void)
+   {                            // Close one object
+      if (n.at[n.level - 1] != n.depth)
+         errx (1, "%s: # conditional splits object %.*s", m->name, n.len[n.level - 1], n.name[n.level - 1]);
+      n.level--;
+      if (mode == 0)
+      {
+         indent (1);
+         fprintf (O, "} ");
+         cname (O, n.name[n.level], n.name[n.level] + n.len[n.level]);
+         fprintf (O, ";\n");
+      } else if (mode == 1)
+         fprintf (O, "   jo_close (j);\n");
+   }
+   int common (field_t * f)
+   {                            // How many open objects are in the path of the next field
+      while (f && f->define)
+         f = f->next;
+      const char *p = (f ? f->name : "");
+      int l = 0;
+      while (l < n.level && !strncmp (p, n.name[l], n.len[l]) && p[n.len[l]] == '.')
+         p += n.len[l++] + 1;
+      return l;
+   }
+   void define (field_t * f)
+   {                            // # line, closing any objects opened within the conditional being left, or not needed for next field
+      const char *d = f->define,
+         *p = d + 1;
+      int l = common (f->next);
+      while (n.level > l && n.at[n.level - 1] == n.depth)
+         close ();
+      while (is_space (*p))
+         p++;
+      int end = !strncmp (p, "endif", 5),
+         els = !strncmp (p, "el", 2);
+      if (end || els)
+         while (n.level && n.at[n.level - 1] >= n.depth)
+            close ();
+      fprintf (O, "%s\n", d);
+      if (!strncmp (p, "if", 2))
+         n.depth++;
+      if (end)
+         n.depth--;
+   }
+   for (field_t * f = m->fields; f; f = f->next)
+   {
+      if (f->define)
+      {
+         define (f);
+         continue;
+      }
+      // Close objects not in this path
+      int l = common (f);
+      while (n.level > l)
+         close ();
+      const char *p = f->name;
+      for (int i = 0; i < l; i++)
+         p += n.len[i] + 1;
+      // Open objects in this path
+      const char *dot;
+      while ((dot = strchr (p, '.')))
+      {
+         if (n.level == sizeof (n.name) / sizeof (*n.name))
+            errx (1, "%s: too deep %s", m->name, f->name);
+         n.name[n.level] = p;
+         n.len[n.level] = dot - p;
+         n.at[n.level] = n.depth;
+         if (mode == 0)
+         {
+            indent (1);
+            fprintf (O, "struct\n");
+            indent (1);
+            fprintf (O, "{\n");
+         } else if (mode == 1)
+            fprintf (O, "   jo_object (j, \"%.*s\");\n", (int) (dot - p), p);
+         n.level++;
+         p = dot + 1;
+      }
+      int len;
+      const type_t *t = gettype (f->type, &len);
+      if (mode == 0)
+      {                         // Member
+         indent (1);
+         fprintf (O, "%s%s", t->ctype, *t->ctype && t->ctype[strlen (t->ctype) - 1] == '*' ? "" : " ");
+         cname (O, p, p + strlen (p));
+         if (*t->type == 'c')
+            fprintf (O, "[%d]", len + 1);
+         fprintf (O, ";");
+         if (f->comment)
+            fprintf (O, "\t// %s", f->comment);
+         fprintf (O, "\n");
+      } else if (mode == 1)
+      {                         // Serialise
+         fprintf (O, "   ");
+         if (!t->get)
+            fprintf (O, "if (v->");
+         else
+            fprintf (O, "%s (j, \"%s\", %sv->", t->put, p, !strcmp (t->type, "u64") ? "\"%\" PRIu64, " : "");
+         member (O, f->name);
+         if (!t->get)
+         {
+            fprintf (O, ")\n      %s (j, \"%s\", v->", t->put, p);
+            member (O, f->name);
+         }
+         if (!strcmp (t->type, "fixed"))
+            fprintf (O, ", %d", len);
+         if (*t->type == 'c')
+         {                      // Length, as may not be null terminated, up to N as parsed
+            fprintf (O, ", strnlen (v->");
+            member (O, f->name);
+            fprintf (O, ", sizeof (v->");
+            member (O, f->name);
+            fprintf (O, ") - 1)");
+         }
+         fprintf (O, ");\n");
+      } else if (t->get)
+      {                         // Parse table entry
+         fprintf (O, "      {.path = \"%s\",", f->name);
+         fprintf (O, ".cb = schema_%s,.arg = &v->", t->get);
+         member (O, f->name);
+         if (*t->type == 'c')
+         {
+            fprintf (O, ",.len = sizeof (v->");
+            member (O, f->name);
+            fprintf (O, ")");
+         }
+         fprintf (O, "},\n");
+      }
+   }
+   while (n.level)
+      close ();
+}
+
+int
+main (int argc, const char *argv[])
+{
+   const char *cfile = "schema.c";
+   const char *hfile = "schema.h";
+   const char *extension = "schema";
+   poptContext optCon;          // context for parsing command-line options
+   {                            // POPT
+      const struct poptOption optionsTable[] = {
+         {"c-file", 'c', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &cfile, 0, "C-file", "filename"},
+         {"h-file", 'h', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &hfile, 0, "H-file", "filename"},
+         {"extension", 'e', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &extension, 0, "Only handle files ending with this",
+          "extension"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+      poptSetOtherOptionHelp (optCon, "Schema-files");
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (!poptPeekArg (optCon))
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+
+   FILE *C = fopen (cfile, "w+");
+   if (!C)
+      err (1, "Cannot open %s", cfile);
+   FILE *H = fopen (hfile, "w+");
+   if (!H)
+      err (1, "Cannot open %s", hfile);
+
+   fprintf (C, "// Message schemas\n");
+   fprintf (C, "// Generated from:-\n");
+   fprintf (H, "// Message schemas, include after revk.h\n");
+   fprintf (H, "// Generated from:-\n");
+
+   msg_t *msgs = NULL,
+      *msglast = NULL;
+   char *line = NULL;
+   size_t len = 0;
+   const char *fn;
+   while ((fn = poptGetArg (optCon)))
+   {
+      char *ext = strrchr (fn, '.');
+      if (!ext || strcmp (ext + 1, extension))
+         continue;
+      fprintf (C, "// %s\n", fn);
+      fprintf (H, "// %s\n", fn);
+      FILE *I = fopen (fn, "r");
+      if (!I)
+         err (1, "Cannot open %s", fn);
+      msg_t *m = NULL;
+      while (getline (&line, &len, I) >= 0)
+      {
+         char *p;
+         for (p = line + strlen (line); p > line && is_space (p[-1]); p--);
+         *p = 0;
+         p = line;
+         while (*p && is_space (*p))
+            p++;
+         if (!*p || (*p == '/' && p[1] == '/'))
+            continue;
+         field_t *f = calloc (1, sizeof (*f));
+         if (*p == '#')
+            f->define = strdup (p);
+         else
+         {
+            char *comment = strstr (p, "//");
+            if (comment)
+            {
+               char *e = comment;
+               comment += 2;
+               while (*comment && is_space (*comment))
+                  comment++;
+               while (e > p && is_space (e[-1]))
+                  e--;
+               *e = 0;
+            }
+            f->type = p;
+            while (*p && !is_space (*p))
+               p++;
+            while (*p && is_space (*p))
+               *p++ = 0;
+            f->name = p;
+            while (*p && !is_space (*p))
+               p++;
+            if (*p)
+               errx (1, "Extra after %s in %s", f->name, fn);
+            if (!*f->name)
+               errx (1, "Missing name for %s in %s", f->type, fn);
+            f->type = strdup (f->type);
+            f->name = strdup (f->name);
+            if (comment)
+               f->comment = strdup (comment);
+            if (!strcmp (f->type, "message"))
+            {                   // New message
+               m = calloc (1, sizeof (*m));
+               m->name = f->name;
+               m->comment = f->comment;
+               free (f->type);
+               free (f);
+               for (p = m->name; *p; p++)
+                  if (!is_alnum (*p) && *p != '_')
+                     errx (1, "Bad message name %s in %s", m->name, fn);
+               if (msgs)
+                  msglast->next = m;
+               else
+                  msgs = m;
+               msglast = m;
+               continue;
+            }
+            int n;
+            if (!gettype (f->type, &n))
+               errx (1, "Unknown type %s for %s in %s", f->type, f->name, fn);
+            for (p = f->name; *p; p++)
+               if (*p < ' ' || *p >= 0x7F || *p == '"' || *p == '\\' || (*p == '.' && (p == f->name || !p[1] || p[1] == '.')))
+                  errx (1, "Bad name %s in %s", f->name, fn);
+         }
+         if (!m)
+            errx (1, "Expecting message before %s in %s", f->define ? : f->name, fn);
+         if (m->fields)
+            m->last->next = f;
+         else
+            m->fields = f;
+         m->last = f;
+      }
+      fclose (I);
+   }
+
+   fprintf (C, "\n#include \"revk.h\"\n#include <inttypes.h>\n#include \"%s\"\n", hfile);
+   {                            // Parse helpers, for those used
+      const char *done[sizeof (types) / sizeof (*types)] = { 0 };
+      for (int t = 0; t < sizeof (types) / sizeof (*types); t++)
+      {
+         const char *g = types[t].get;
+         if (!g)
+            continue;
+         int d;
+         for (d = 0; d < t && (!done[d] || strcmp (done[d], g)); d++);
+         if (d < t)
+            continue;
+         msg_t *m;
+         for (m = msgs; m; m = m->next)
+         {
+            field_t *f;
+            for (f = m->fields; f; f = f->next)
+            {
+               int n;
+               const char *fg = (f->define ? NULL : gettype (f->type, &n)->get);
+               if (fg && !strcmp (fg, g))
+                  break;
+            }
+            if (f)
+               break;
+         }
+         if (!m)
+            continue;
+         done[t] = g;
+         fprintf (C, "\nstatic void __attribute__ ((unused))\nschema_%s (jo_t j, jo_find_t * f)\n{\n", g);   // Unused if only in # conditional
+         if (!strcmp (g, "bit"))
+            fprintf (C, "   jo_type_t t = jo_here (j);\n   if (t >= JO_TRUE)\n      *(uint8_t *) f->arg = (t == JO_TRUE);\n");
+         else if (!strcmp (g, "f"))
+            fprintf (C, "   if (jo_here (j) == JO_NUMBER)\n      *(double *) f->arg = jo_read_float (j);\n");
+         else if (!strcmp (g, "u64"))
+            fprintf (C, "   if (jo_here (j) == JO_NUMBER)\n   {                            // Unsigned, as jo_read_int is signed\n      char n[22];\n      if (jo_strncpy (j, n, sizeof (n)) < sizeof (n))\n         *(uint64_t *) f->arg = strtoull (n, NULL, 10);\n   }\n");
+         else if (!strcmp (g, "time"))
+            fprintf (C, "   if (jo_here (j) == JO_STRING)\n      *(time_t *) f->arg = jo_read_datetime (j);\n");
+         else if (!strcmp (g, "c"))
+            fprintf (C, "   if (jo_here (j) == JO_STRING)\n      jo_strncpy (j, f->arg, f->len);\n");
+         else if (types[t].imin)
+            fprintf (C,
+                     "   if (jo_here (j) == JO_NUMBER)\n   {                            // Ignored if out of range\n      int64_t v = jo_read_int (j);\n      if (v >= %s && v <= %s)\n         *(%s *) f->arg = v;\n   }\n",
+                     types[t].imin, types[t].imax, types[t].ctype);
+         else
+            fprintf (C, "   if (jo_here (j) == JO_NUMBER)\n      *(%s *) f->arg = jo_read_int (j);\n", types[t].ctype);
+         fprintf (C, "}\n");
+      }
+   }
+
+   for (msg_t * m = msgs; m; m = m->next)
+   {
+      int max = 3;              // {} and null
+      for (field_t * f = m->fields; f && max; f = f->next)
+         if (!f->define)
+         {
+            int n;
+            const type_t *t = gettype (f->type, &n);
+            int v = valuemax (t, n);
+            if (!v)
+               max = 0;
+            else
+            {
+               const char *p = f->name;
+               for (const char *d = p; *d; d++)
+                  if (*d == '.')
+                     max += 2;  // Object
+               max += strlen (f->name) + 4 + v; // Tags, quotes, colons, commas
+            }
+         }
+      // Header
+      fprintf (H, "\n");
+      if (m->comment)
+         fprintf (H, "// %s\n", m->comment);
+      fprintf (H, "typedef struct %s_s %s_t;\n", m->name, m->name);
+      fprintf (H, "struct %s_s\n{\n", m->name);
+      gen (H, m, 0);
+      fprintf (H, "};\n");
+      if (max)
+      {
+         fprintf (H, "#define\t");
+         for (const char *p = m->name; *p; p++)
+            fputc (toupper ((unsigned char) *p), H);
+         fprintf (H, "_MAX\t%d\t// Max JSON length (with null)\n", max);
+      }
+      fprintf (H, "void %s_jo (jo_t j, const %s_t * v);\t// Add fields to the object being created in j\n", m->name, m->name);
+      fprintf (H, "jo_t %s_make (const %s_t * v);\t// New JSON object with all fields%s\n", m->name, m->name,
+               max ? ", allocated once at max length" : "");
+      fprintf (H, "int %s_parse (jo_t j, %s_t * v);\t// Set fields found in j, in one pass, returns number found\n", m->name,
+               m->name);
+      // Serialise
+      fprintf (C, "\nvoid\n%s_jo (jo_t j, const %s_t * v)\n{\n", m->name, m->name);
+      gen (C, m, 1);
+      fprintf (C, "}\n");
+      fprintf (C, "\njo_t\n%s_make (const %s_t * v)\n{\n   jo_t j = jo_object_alloc ();\n", m->name, m->name);
+      if (max)
+         fprintf (C, "   j = jo_pad (&j, %d);\n", max);
+      fprintf (C, "   if (j)\n      %s_jo (j, v);\n   return j;\n}\n", m->name);
+      // Parse
+      fprintf (C, "\nint\n%s_parse (jo_t j, %s_t * v)\n{\n   jo_find_t f[] = {\n", m->name, m->name);
+      gen (C, m, 2);
+      fprintf (C, "   };\n   return jo_find_many (j, f, sizeof (f) / sizeof (*f));\n}\n");
+   }
+
+   fclose (H);
+   fclose (C);
+   poptFreeContext (optCon);
+   return 0;
+}
@@ -1402,9 +1402,13 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
    char tag[16];
    revk_setting_bits_t found = { 0 };
    const char *location = NULL;
-   char *bitused = mallocspi (sizeof (revk_settings_bits));
+   jo_arena_t arena = jo_arena (sizeof (revk_settings_bits) + 256);     // Working space, values and temp, all freed at the end
+   char *bitused = jo_arena_alloc (arena, sizeof (revk_settings_bits));
    if (!bitused)
+   {
+      jo_arena_free (&arena);
       return "malloc";
+   }
    memset (bitused, 0, sizeof (revk_settings_bits));
    const char *scan (int plen, int pindex)
    {
@@ -1415,13 +1419,19 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
       while (!err && (t = jo_here (j)) == JO_TAG)
       {
          location = jo_debug (j);
-         int l = jo_strlen (j);
+         const char *v;
+         int l = jo_view (j, &v);
          if (l + plen > sizeof (tag) - 1)
             return "Tag too long";
-         jo_strncpy (j, tag + plen, l + 1);
+         if (v)
+         {                      // No escaping
+            memcpy (tag + plen, v, l);
+            tag[plen + l] = 0;
+         } else
+            jo_strncpy (j, tag + plen, l + 1);
          revk_settings_t *s;
          for (s = revk_settings; s->len && (s->len != plen + l || (plen && s->dot != plen) || strcmp (s->name, tag)); s++);
-         const char *store (int index)
+         const char *storeval (int index)
          {                      // Store simple value from here - does not advance j
             if (!s->len)
             {
@@ -1463,37 +1473,31 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
                {
                   if (t != JO_STRING)
                      return "String expected";
-                  val = jo_strdup (j);  // Web interface, JSON is in a string
+                  val = jo_strdup_arena (j, arena);     // Web interface, JSON is in a string
                   if (!*val)
                   {
-                     val = strdup ((char *) s->def ? : "");
+                     val = jo_arena_strdup (arena, (char *) s->def ? : "");
                      t = JO_NULL;       // This is default
                   } else
                   {
                      t = JO_STRING;     // Not default
                      // Check syntax
-                     jo_t test = jo_parse_str (val);
-                     jo_skip (test);
+                     jo_t test = jo_parse_str_arena (arena, val);
+                     jo_validate (test);
                      err = jo_error (test, NULL);
                      if (err)
-                     {
-                        free (val);
                         return err;
-                     }
                   }
                } else
                {
                   if (t == JO_NULL)
-                     val = strdup ("");
+                     val = "";
                   else
-                     val = jo_strdupj (j);      // Raw JSON
+                     val = jo_strdupj_arena (j, arena); // Raw JSON
                   t = JO_STRING;        // Not default
                   err = jo_error (j, NULL);
                   if (err)
-                  {
-                     free (val);
                      return err;
-                  }
                }
             } else
 #endif
@@ -1528,7 +1532,7 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
                      }
                   }
 #endif
-                  val = strdup (val);
+                  val = jo_arena_strdup (arena, val);
 #ifdef	REVK_SETTINGS_HAS_NUMERIC
                   if (s->array && (0
 #ifdef	REVK_SETTINGS_HAS_SIGNED
@@ -1547,9 +1551,9 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
 #endif
                }
             } else if (t != JO_CLOSE)
-               val = jo_strdup (j);
+               val = jo_strdup_arena (j, arena);
             int len = s->malloc ? sizeof (void *) : s->size ? : 1;
-            uint8_t *temp = mallocspi (len);
+            uint8_t *temp = jo_arena_alloc (arena, len);
             if (!temp)
                err = "malloc";
             else
@@ -1572,8 +1576,6 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
                                                                                                         !*(char **) ptr
                                                                                                         || **((char **) ptr)))
                {                // Secret is dummy, unless current value is empty string in which case dummy value is allowed
-                  free (val);
-                  free (temp);
                   return NULL;
                }
                err = load_value (s, val, index, temp);
@@ -1642,23 +1644,29 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
                }
                if (dofree)
                   free (*(void **) temp);
-               free (temp);
             }
-            free (val);
             return err;
          }
+         const char *store (int index)
+         {                      // Store, freeing working space after
+            void *mark = jo_arena_mark (arena);
+            const char *e = storeval (index);
+            jo_arena_release (arena, mark);
+            return e;
+         }
          t = jo_next (j);
 #ifdef  CONFIG_REVK_SETTINGS_PASSWORD
          if (!(flags & REVK_SETTINGS_PASSOVERRIDE) && s->ptr == &password)
          {
-            char *val = jo_strdup (j);
+            void *mark = jo_arena_mark (arena);
+            char *val = jo_strdup_arena (j, arena);
             if (!val || !*val)
                err = "Specify password";
             else if (!strcmp (val, password))
                flags |= REVK_SETTINGS_PASSOVERRIDE;
             else
                err = "Wrong password";
-            free (val);
+            jo_arena_release (arena, mark);
          }
          if (!err && !(flags & REVK_SETTINGS_PASSOVERRIDE))
             err = "Password required to change settings";
@@ -1805,6 +1813,7 @@ revk_settings_store (jo_t j, const char **locationp, uint8_t flags)
       return err;
    }
    err = scan (0, -1);
+   jo_arena_free (&arena);
    if (reload)
    {
       revk_restart (3, "Settings changed (%s)", reload);